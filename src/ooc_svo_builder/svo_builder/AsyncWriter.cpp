@@ -0,0 +1,116 @@
+#include "AsyncWriter.h"
+#include <stdlib.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <malloc.h>
+#endif
+
+// Allocate / free a buffer aligned to ASYNC_WRITER_ALIGNMENT
+static char* alignedAlloc(const size_t size){
+#if defined(_WIN32) || defined(_WIN64)
+	return (char*) _aligned_malloc(size, ASYNC_WRITER_ALIGNMENT);
+#else
+	void* p = NULL;
+	if (posix_memalign(&p, ASYNC_WRITER_ALIGNMENT, size) != 0){ return NULL; }
+	return (char*) p;
+#endif
+}
+
+static void alignedFree(char* p){
+#if defined(_WIN32) || defined(_WIN64)
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+// Open the file and start the writer thread
+AsyncWriter::AsyncWriter(const std::string &filename, Timer* io_timer, Timer* busy_timer, size_t buffersize, size_t n_buffers) :
+file(NULL), filename(filename), buffersize(buffersize), current(NULL), done(false), io_timer(io_timer), busy_timer(busy_timer) {
+	file = fopen(filename.c_str(), "wb");
+	if (file == NULL){
+		cout << "Error: could not open " << filename << " for writing." << endl;
+		exit(1);
+	}
+	setvbuf(file, NULL, _IONBF, 0); // our buffers are large enough, skip the stdio buffer
+	blocks.resize(n_buffers);
+	for (size_t i = 0; i < n_buffers; i++){
+		blocks[i].data = alignedAlloc(buffersize);
+		blocks[i].size = 0;
+		free_blocks.push_back(&blocks[i]);
+	}
+	current = free_blocks.front();
+	free_blocks.pop_front();
+	writer = thread(&AsyncWriter::writerLoop, this);
+}
+
+AsyncWriter::~AsyncWriter(){
+	close();
+	for (size_t i = 0; i < blocks.size(); i++){
+		alignedFree(blocks[i].data);
+	}
+}
+
+// Hand the current buffer to the writer thread and get a free one, waiting if the ring is full
+void AsyncWriter::flush(){
+	if (busy_timer){ busy_timer->stop(); }
+	if (io_timer){ io_timer->start(); }
+	{
+		unique_lock<mutex> l(lock);
+		full_blocks.push_back(current);
+		block_filled.notify_one();
+		while (free_blocks.empty()){
+			block_freed.wait(l);
+		}
+		current = free_blocks.front();
+		free_blocks.pop_front();
+	}
+	if (io_timer){ io_timer->stop(); }
+	if (busy_timer){ busy_timer->start(); }
+}
+
+// Write out everything that's left, stop the writer thread and close the file
+void AsyncWriter::close(){
+	if (file == NULL){ return; }
+	if (busy_timer){ busy_timer->stop(); }
+	if (io_timer){ io_timer->start(); }
+	{
+		unique_lock<mutex> l(lock);
+		if (current->size > 0){
+			full_blocks.push_back(current);
+		}
+		done = true;
+		block_filled.notify_one();
+	}
+	writer.join();
+	fclose(file);
+	file = NULL;
+	if (io_timer){ io_timer->stop(); }
+	if (busy_timer){ busy_timer->start(); }
+}
+
+// Writer thread: write full buffers to disk in order, until we're done and nothing is left
+void AsyncWriter::writerLoop(){
+	while (true){
+		Block* b;
+		{
+			unique_lock<mutex> l(lock);
+			while (full_blocks.empty() && !done){
+				block_filled.wait(l);
+			}
+			if (full_blocks.empty()){ return; } // done, and nothing left to write
+			b = full_blocks.front();
+			full_blocks.pop_front();
+		}
+		double start = omp_get_wtime();
+		if (fwrite(b->data, 1, b->size, file) != b->size){
+			cout << "Error: writing to " << filename << " failed." << endl;
+		}
+		write_seconds += omp_get_wtime() - start;
+		{
+			unique_lock<mutex> l(lock);
+			b->size = 0;
+			free_blocks.push_back(b);
+			block_freed.notify_one();
+		}
+	}
+}
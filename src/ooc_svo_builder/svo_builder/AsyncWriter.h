@@ -0,0 +1,78 @@
+#ifndef ASYNC_WRITER_H_
+#define ASYNC_WRITER_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "svo_builder_util.h"
+#include "FileWriter.h"
+
+using namespace std;
+
+// Default output buffering: a ring of 4 buffers of 8 Mb each
+#define ASYNC_WRITER_BUFFERSIZE (8 * 1024 * 1024)
+#define ASYNC_WRITER_NBUFFERS 4
+#define ASYNC_WRITER_ALIGNMENT 4096
+
+// A buffered file writer. Data is gathered in large aligned buffers, full buffers are handed to a
+// dedicated writer thread through a bounded ring, so the producer only blocks when the disk can't keep up.
+class AsyncWriter : public FileWriter {
+public:
+	AsyncWriter(const std::string &filename, Timer* io_timer = NULL, Timer* busy_timer = NULL,
+		size_t buffersize = ASYNC_WRITER_BUFFERSIZE, size_t n_buffers = ASYNC_WRITER_NBUFFERS);
+	~AsyncWriter();
+
+	void write(const void* data, const size_t bytes);
+	void close();
+
+private:
+	struct Block {
+		char* data;
+		size_t size;
+	};
+
+	FILE* file;
+	string filename;
+	size_t buffersize;
+	vector<Block> blocks; // all buffers in the ring
+	Block* current; // buffer we're currently filling
+	deque<Block*> free_blocks; // buffers ready to be filled
+	deque<Block*> full_blocks; // buffers waiting to be written
+	bool done;
+	mutex lock;
+	condition_variable block_freed;
+	condition_variable block_filled;
+	thread writer;
+
+	// Timers to account for the time we spend waiting on the writer (once per flush, not per item)
+	Timer* io_timer;
+	Timer* busy_timer;
+
+	void flush();
+	void writerLoop();
+};
+
+// Copy data into the current buffer, handing full buffers to the writer thread
+inline void AsyncWriter::write(const void* data, const size_t bytes){
+	const char* src = (const char*) data;
+	size_t remaining = bytes;
+	while (remaining > 0){
+		size_t n = min(remaining, buffersize - current->size);
+		memcpy(current->data + current->size, src, n);
+		current->size += n;
+		src += n;
+		remaining -= n;
+		if (current->size == buffersize){
+			flush();
+		}
+	}
+	bytes_written += bytes;
+}
+
+#endif // ASYNC_WRITER_H_
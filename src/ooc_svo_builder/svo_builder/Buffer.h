@@ -5,51 +5,68 @@
 #include <vector>
 #include <tri_util.h>
 #include <tri_tools.h>
+#include <file_tools.h>
 #include "globals.h"
 #include "intersection.h"
+#include "PartitionWriter.h"
 
 using namespace std;
 using namespace trimesh;
 
 // A Buffer which checks triangles against a bounding box, and writes them in batches to a given file/stream if they fit.
+// With a PartitionWriter, full batches are handed to its writer threads instead of being written right away.
 class Buffer{
 public:
 	FILE* file; // the file we'll write our triangles to
 	string filename; // filename of the file we're writing to
 	AABox<vec3> bbox_world; // bounding box of the morton grid this buffer represents, in world coords
 	size_t n_triangles; // number of triangles already in
+	size_t n_flushed; // number of triangles already handed to the file (or the writer)
+	bool shared_file; // the file is a container shared with other buffers, we own the extent starting at file_first
+	size_t file_first; // position (in triangles) of our first triangle in a shared file
+	PartitionWriter* writer; // background writer for our batches (NULL: we write them ourselves)
 
 	// Buffered
 	vector<Triangle> triangle_buffer; // triangle buffer
 	size_t buffer_max; // maximum of tris we buffer before writing to disk
 
 	Buffer();
-	Buffer(const std::string &filename, AABox<vec3> bbox_world, size_t buffer_max);
+	Buffer(const std::string &filename, AABox<vec3> bbox_world, size_t buffer_max, PartitionWriter* writer = NULL);
+	Buffer(FILE* container, size_t file_first, AABox<vec3> bbox_world, size_t buffer_max, PartitionWriter* writer = NULL);
 	~Buffer();
 
 	void processTriangle(Triangle &t, const AABox<vec3> &bbox);
+	void addTriangle(Triangle &t);
+	void addTriangles(Triangle* t, const size_t n);
 
 private:
 	void flush();
+	void seekExtent(const size_t written);
 };
 
 // default constructor
-inline Buffer::Buffer() : bbox_world(AABox<vec3>(vec3(),vec3(1,1,1))), n_triangles(0), buffer_max(1024), file(NULL), filename(""){
+inline Buffer::Buffer() : bbox_world(AABox<vec3>(vec3(),vec3(1,1,1))), n_triangles(0), n_flushed(0), shared_file(false), file_first(0), writer(NULL), buffer_max(1024), file(NULL), filename(""){
 }
 
 // full constructor
-inline Buffer::Buffer(const std::string &filename, AABox<vec3> bbox_world, size_t buffer_max): bbox_world(bbox_world), n_triangles(0), buffer_max(buffer_max), file(NULL), filename(filename) {
+inline Buffer::Buffer(const std::string &filename, AABox<vec3> bbox_world, size_t buffer_max, PartitionWriter* writer): bbox_world(bbox_world), n_triangles(0), n_flushed(0), shared_file(false), file_first(0), writer(writer), buffer_max(buffer_max), file(NULL), filename(filename) {
 	triangle_buffer.reserve(buffer_max); // prepare buffer
 	file = NULL;
 }
 
+// constructor for a buffer writing to its extent in an (already opened and sized) container file
+inline Buffer::Buffer(FILE* container, size_t file_first, AABox<vec3> bbox_world, size_t buffer_max, PartitionWriter* writer): bbox_world(bbox_world), n_triangles(0), n_flushed(0), shared_file(true), file_first(file_first), writer(writer), buffer_max(buffer_max), file(container), filename("") {
+	triangle_buffer.reserve(buffer_max); // prepare buffer
+}
+
 //destructor
 inline Buffer::~Buffer(){
 	if(buffer_max != 0){
 		flush();
 	}
-	if(file != NULL){ // only close the file if we opened it.
-		fclose(file);
+	if(file != NULL && !shared_file){ // only close the file if we opened it.
+		if(writer != NULL){ writer->close(file); } // once its last batch is written
+		else { fclose(file); }
 	}
 }
 
@@ -62,26 +79,64 @@ inline void Buffer::flush(){
 		file = fopen(filename.c_str(), "wb");
 	}
 	part_algo_timer.stop(); part_io_out_timer.start(); // TIMING
-	writeTriangles(file,triangle_buffer[0],triangle_buffer.size());
+	if(writer != NULL){ // hand the batch over, we only wait if the writer has too much queued already
+		const size_t n = triangle_buffer.size();
+		writer->submit(file, (file_first + n_flushed) * TRIANGLE_SIZE * sizeof(float), triangle_buffer);
+		triangle_buffer.reserve(buffer_max);
+		n_flushed += n;
+	} else {
+		seekExtent(n_flushed);
+		writeTriangles(file,triangle_buffer[0],triangle_buffer.size());
+		n_flushed += triangle_buffer.size();
+		triangle_buffer.clear();
+	}
 	part_io_out_timer.stop(); part_algo_timer.start();  // TIMING
-	triangle_buffer.clear();
+}
+
+// In a shared file, go to where the next triangle of our extent goes, after the ones we've written already
+inline void Buffer::seekExtent(const size_t written){
+	if(shared_file){
+		seek_file(file, (file_first + written) * TRIANGLE_SIZE * sizeof(float));
+	}
 }
 
 // Check triangle against buffer bounding box and add it to buffer if it is in it.
 inline void Buffer::processTriangle(Triangle &t, const AABox<vec3> &bbox){
 	if(intersectBoxBox(bbox, bbox_world)){ // triangle in this partition
-		if(buffer_max == 0){ // no buffering, just write triangle
-			part_algo_timer.stop(); part_io_out_timer.start(); // TIMING
-			writeTriangle(file, t);
-			part_io_out_timer.stop(); part_algo_timer.start();  // TIMING
-		} else { // add to buffer
-			triangle_buffer.push_back(t);
-			if(triangle_buffer.size() >= buffer_max) { // buffer full, writeout to files
-				flush();
-			}
+		addTriangle(t);
+	}
+}
+
+// Add a triangle we already know to be in this partition
+inline void Buffer::addTriangle(Triangle &t){
+	if(buffer_max == 0){ // no buffering, just write triangle
+		part_algo_timer.stop(); part_io_out_timer.start(); // TIMING
+		seekExtent(n_triangles);
+		writeTriangle(file, t);
+		part_io_out_timer.stop(); part_algo_timer.start();  // TIMING
+	} else { // add to buffer
+		triangle_buffer.push_back(t);
+		if(triangle_buffer.size() >= buffer_max) { // buffer full, writeout to files
+			flush();
+		}
+	}
+	n_triangles++;
+}
+
+// Add a batch of triangles we already know to be in this partition
+inline void Buffer::addTriangles(Triangle* t, const size_t n){
+	if(buffer_max == 0){ // no buffering, just write triangles
+		part_algo_timer.stop(); part_io_out_timer.start(); // TIMING
+		seekExtent(n_triangles);
+		writeTriangles(file, t[0], n);
+		part_io_out_timer.stop(); part_algo_timer.start();  // TIMING
+	} else { // add to buffer
+		triangle_buffer.insert(triangle_buffer.end(), t, t + n);
+		if(triangle_buffer.size() >= buffer_max) { // buffer full, writeout to files
+			flush();
 		}
-		n_triangles++;
 	}
+	n_triangles += n;
 }
 
 #endif // BUFFER_H_
\ No newline at end of file
@@ -0,0 +1,81 @@
+#ifndef DAG_TABLE_H_
+#define DAG_TABLE_H_
+
+#include <string.h>
+#include <unordered_map>
+#include "Node.h"
+
+using namespace std;
+
+// A block of (up to 8) sibling nodes, as it would be written to the node file
+struct DagBlock {
+	unsigned char count;
+	unsigned char level; // octree level of the nodes: with level-local addresses, equal words on other levels mean other nodes
+	size_t words[8 * 3]; // data, children base and child offsets of every node
+
+	DagBlock() : count(0), level(0) {}
+
+	template <typename Payload>
+	void add(const Node<Payload> &n){
+		size_t* w = &words[3 * count];
+		w[0] = n.data;
+		w[1] = n.children_base;
+		memcpy(&w[2], n.children_offset, 8);
+		count++;
+	}
+
+	bool operator==(const DagBlock &b) const{
+		return count == b.count && level == b.level && memcmp(words, b.words, 3 * count * sizeof(size_t)) == 0;
+	}
+};
+
+struct DagBlockHash {
+	size_t operator()(const DagBlock &b) const{
+		uint64_t h = 14695981039346656037ULL ^ b.count ^ ((uint64_t)b.level << 8); // FNV-1a over the words
+		for (int i = 0; i < 3 * b.count; i++){
+			h = (h ^ (uint64_t)b.words[i]) * 1099511628211ULL;
+		}
+		return (size_t)(h ^ (h >> 32));
+	}
+};
+
+// Table of children blocks we've already written, to turn the SVO into a DAG by reusing identical subtrees.
+// Because children blocks are written bottom-up, a block only refers to blocks that are already deduplicated,
+// so two blocks are the same subtree if their words are equal. Memory is bounded by keeping two generations:
+// when the current one is full, the older one is dropped. Forgetting blocks only costs us some sharing.
+class DagTable {
+public:
+	size_t max_entries; // per generation
+	size_t reused_blocks; // statistics
+	size_t reused_nodes;
+
+	DagTable(const size_t max_entries) : max_entries(max_entries), reused_blocks(0), reused_nodes(0) {}
+
+	// Look up a block, returns true and its position if we've seen it before
+	bool find(const DagBlock &b, size_t &pos){
+		unordered_map<DagBlock, size_t, DagBlockHash>::const_iterator it = current.find(b);
+		if (it == current.end()){
+			it = previous.find(b);
+			if (it == previous.end()){ return false; }
+		}
+		pos = it->second;
+		reused_blocks++;
+		reused_nodes += b.count;
+		return true;
+	}
+
+	// Remember the position of a block we just wrote
+	void insert(const DagBlock &b, const size_t pos){
+		if (current.size() >= max_entries){
+			previous.swap(current);
+			current.clear();
+		}
+		current[b] = pos;
+	}
+
+private:
+	unordered_map<DagBlock, size_t, DagBlockHash> current;
+	unordered_map<DagBlock, size_t, DagBlockHash> previous;
+};
+
+#endif // DAG_TABLE_H_
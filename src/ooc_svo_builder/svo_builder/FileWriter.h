@@ -0,0 +1,23 @@
+#ifndef FILE_WRITER_H_
+#define FILE_WRITER_H_
+
+#include <stdio.h>
+
+// Interface for the writers the octree builder writes its output files with
+class FileWriter {
+public:
+	size_t bytes_written; // total amount of bytes handed to this writer
+	double write_seconds; // time spent getting the data to disk (in the background, for some writers)
+
+	FileWriter() : bytes_written(0), write_seconds(0) {}
+	virtual ~FileWriter() {}
+
+	// Append data to the file
+	virtual void write(const void* data, const size_t bytes) = 0;
+	// Reserve room for the next bytes in the file and return a pointer to fill them in directly, in any order
+	// and from any thread. Returns NULL if this writer can't do that. The pointer is valid until the next call.
+	virtual char* reserve(const size_t /*bytes*/) { return NULL; }
+	virtual void close() = 0;
+};
+
+#endif // FILE_WRITER_H_
@@ -0,0 +1,77 @@
+#include "MappedWriter.h"
+
+#ifdef MAPPED_WRITER_AVAILABLE
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <algorithm>
+#include <omp.h>
+
+// Open the file and map its first, preallocated chunk
+MappedWriter::MappedWriter(const std::string &filename, Timer* io_timer, Timer* busy_timer, size_t initial_size) :
+fd(-1), filename(filename), map(NULL), capacity(0), size(0), io_timer(io_timer), busy_timer(busy_timer) {
+	fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0){
+		cout << "Error: could not open " << filename << " for writing." << endl;
+		exit(1);
+	}
+	grow(initial_size);
+}
+
+MappedWriter::~MappedWriter(){
+	close();
+}
+
+// Preallocate the file to (at least) the needed size and remap it. Doubles the capacity, so this rarely happens.
+void MappedWriter::grow(const size_t needed){
+	if (busy_timer){ busy_timer->stop(); }
+	if (io_timer){ io_timer->start(); }
+	const double start = omp_get_wtime();
+	size_t new_capacity = max(max(needed, capacity * 2), (size_t)MAPPED_WRITER_CHUNK);
+	new_capacity = (new_capacity + MAPPED_WRITER_CHUNK - 1) / MAPPED_WRITER_CHUNK * MAPPED_WRITER_CHUNK;
+	bool allocated = false;
+#if defined(__linux__)
+	allocated = (posix_fallocate(fd, 0, (off_t)new_capacity) == 0); // real blocks, so we can't run out of disk halfway
+#endif
+	if (!allocated && ftruncate(fd, (off_t)new_capacity) != 0){ // file system without fallocate: sparse file
+		cout << "Error: could not grow " << filename << " to " << new_capacity << " bytes." << endl;
+		exit(1);
+	}
+	if (map != NULL){
+		munmap(map, capacity);
+	}
+	void* p = mmap(NULL, new_capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED){
+		cout << "Error: could not map " << filename << " for writing." << endl;
+		exit(1);
+	}
+	map = (char*) p;
+	capacity = new_capacity;
+#if defined(MADV_SEQUENTIAL)
+	madvise(map, capacity, MADV_SEQUENTIAL); // we write front to back
+#endif
+	write_seconds += omp_get_wtime() - start;
+	if (io_timer){ io_timer->stop(); }
+	if (busy_timer){ busy_timer->start(); }
+}
+
+// Unmap the file and cut off the preallocated space we didn't use
+void MappedWriter::close(){
+	if (fd < 0){ return; }
+	if (busy_timer){ busy_timer->stop(); }
+	if (io_timer){ io_timer->start(); }
+	const double start = omp_get_wtime();
+	munmap(map, capacity); // dirty pages are written back by the kernel
+	map = NULL;
+	if (ftruncate(fd, (off_t)size) != 0){
+		cout << "Error: could not truncate " << filename << " to " << size << " bytes." << endl;
+	}
+	::close(fd);
+	fd = -1;
+	write_seconds += omp_get_wtime() - start;
+	if (io_timer){ io_timer->stop(); }
+	if (busy_timer){ busy_timer->start(); }
+}
+
+#endif // MAPPED_WRITER_AVAILABLE
@@ -0,0 +1,63 @@
+#ifndef MAPPED_WRITER_H_
+#define MAPPED_WRITER_H_
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include "svo_builder_util.h"
+#include "FileWriter.h"
+
+using namespace std;
+
+// Memory-mapped output is only available on POSIX systems
+#if !defined(_WIN32) && !defined(_WIN64)
+#define MAPPED_WRITER_AVAILABLE
+
+// The file is preallocated and mapped in chunks of at least 64 Mb, growing by doubling
+#define MAPPED_WRITER_CHUNK (64 * 1024 * 1024)
+
+// A file writer that writes through a shared memory mapping of a preallocated file. Nothing is copied
+// through stdio: reserve() hands out a region of the file itself, which can be filled in at computed offsets
+// from several threads at once. The kernel writes the pages back, the file is truncated to its real size on close.
+class MappedWriter : public FileWriter {
+public:
+	MappedWriter(const std::string &filename, Timer* io_timer = NULL, Timer* busy_timer = NULL, size_t initial_size = MAPPED_WRITER_CHUNK);
+	~MappedWriter();
+
+	void write(const void* data, const size_t bytes);
+	char* reserve(const size_t bytes);
+	void close();
+
+private:
+	int fd;
+	string filename;
+	char* map; // mapping of the first capacity bytes of the file
+	size_t capacity; // preallocated size of the file
+	size_t size; // amount of bytes in use
+
+	// Timers to account for the time we spend growing the file
+	Timer* io_timer;
+	Timer* busy_timer;
+
+	void grow(const size_t needed);
+};
+
+// Reserve the next bytes of the file, growing it if needed
+inline char* MappedWriter::reserve(const size_t bytes){
+	if (size + bytes > capacity){
+		grow(size + bytes);
+	}
+	char* p = map + size;
+	size += bytes;
+	bytes_written += bytes;
+	return p;
+}
+
+// Copy data straight into the mapped file
+inline void MappedWriter::write(const void* data, const size_t bytes){
+	memcpy(reserve(bytes), data, bytes);
+}
+
+#endif // no Windows
+
+#endif // MAPPED_WRITER_H_
@@ -11,16 +11,39 @@
 // This is how an array of a leaf node will look
 const char LEAF[8] = {NOCHILD, NOCHILD, NOCHILD, NOCHILD, NOCHILD, NOCHILD, NOCHILD, NOCHILD};
 
+// Payload policies: what an SVO node carries around while the octree is being built.
+
+// Binary voxelization: all leafs refer to the same white voxel, nodes don't cache any data
+struct BinaryPayload {
+	static const bool has_data = false;
+	VoxelData getCache() const { return VoxelData(); }
+	void setCache(const VoxelData &) {}
+	size_t getCoverage() const { return 1; }
+	void setCoverage(const size_t) {}
+};
+
+// Voxel payload: nodes cache their voxel data, so higher levels can be refined from it
+struct VoxelPayload {
+	static const bool has_data = true;
+	VoxelData data_cache; // only if you want to refine octree (clustering)
+	size_t coverage; // amount of leaf voxels below this node, for coverage-weighted refinement
+	VoxelPayload() : coverage(1) {}
+	const VoxelData& getCache() const { return data_cache; }
+	void setCache(const VoxelData &d) { data_cache = d; }
+	size_t getCoverage() const { return coverage; }
+	void setCoverage(const size_t c) { coverage = c; }
+};
+
 // An SVO node. Only contains child pointers, extend this if you want parent pointers as well
-class Node
+// The payload policy is an (empty, for binary voxelization) base class, so it takes no space if it has no data.
+template <typename Payload>
+class Node : public Payload
 {
 public:
 	size_t data;
 	size_t children_base;
 	char children_offset[8];
 
-	VoxelData data_cache; // only if you want to refine octree (clustering)
-
 	Node();
 	bool hasChild(unsigned int i) const;
 	size_t getChildPos(unsigned int i) const;
@@ -30,17 +53,20 @@ public:
 };
 
 // Default constructor
-inline Node::Node() : data(0), children_base(0), data_cache(VoxelData()){
+template <typename Payload>
+inline Node<Payload>::Node() : Payload(), data(0), children_base(0){
 	memset(children_offset, (char) NOCHILD, 8);
 }
 
 // Check if this Node has a child at position i
-inline bool Node::hasChild(unsigned int i) const{
+template <typename Payload>
+inline bool Node<Payload>::hasChild(unsigned int i) const{
 	return !(children_offset[i] == NOCHILD);
 }
 
 // Get the full index of the child at position i
-inline size_t Node::getChildPos(unsigned int i) const{
+template <typename Payload>
+inline size_t Node<Payload>::getChildPos(unsigned int i) const{
 	if(children_offset[i] == NOCHILD){
 		return 0;
 	} else {
@@ -49,12 +75,14 @@ inline size_t Node::getChildPos(unsigned int i) const{
 }
 
 // If this node doesn't have data and is a leaf node, it's a null node
-inline bool Node::isNull() const{
+template <typename Payload>
+inline bool Node<Payload>::isNull() const{
 	return isLeaf() && !hasData();
 }
 
 // If this node doesn;t have any children, it's a leaf node
-inline bool Node::isLeaf() const{
+template <typename Payload>
+inline bool Node<Payload>::isLeaf() const{
 	if (memcmp(children_offset, LEAF, 8 * sizeof(char)) == 0){
 		return true;
 	}
@@ -62,7 +90,8 @@ inline bool Node::isLeaf() const{
 }
 
 // If the data pointer is NODATA, there is no data
-inline bool Node::hasData() const{
+template <typename Payload>
+inline bool Node<Payload>::hasData() const{
 	return !(data == NODATA);
 }
 
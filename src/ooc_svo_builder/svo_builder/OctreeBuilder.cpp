@@ -1,143 +1,332 @@
 #include "OctreeBuilder.h"
 
 // OctreeBuilder constructor: this initializes the builder and sets up the output files, ready to go
-OctreeBuilder::OctreeBuilder(std::string base_filename, size_t gridlength, bool generate_levels) :
-gridlength(gridlength), b_node_pos(0), b_data_pos(0), b_current_morton(0), generate_levels(generate_levels), base_filename(base_filename) {
+template <typename Payload>
+OctreeBuilder<Payload>::OctreeBuilder(std::string base_filename, size_t gridlength, bool generate_levels, LodFilter lod_filter, OctreeFormat format, OctreeLayout layout, size_t dag_entries, bool mapped_output) :
+gridlength(gridlength), b_node_pos(0), b_data_pos(0), b_current_morton(0), generate_levels(generate_levels), lod_filter(lod_filter), format(format), layout(layout), dag(NULL), base_filename(base_filename) {
 	svo_algo_timer.start();
 
 	// Open output files
 	string nodes_name = base_filename + string(".octreenodes");
 	string data_name = base_filename + string(".octreedata");
-	node_out = fopen(nodes_name.c_str(), "wb");
-	data_out = fopen(data_name.c_str(), "wb");
+#ifdef MAPPED_WRITER_AVAILABLE
+	if (mapped_output){
+		node_out = new MappedWriter(nodes_name, &svo_io_out_timer, &svo_algo_timer);
+		data_out = new MappedWriter(data_name, &svo_io_out_timer, &svo_algo_timer);
+	}
+	else
+#endif
+	{
+		node_out = new AsyncWriter(nodes_name, &svo_io_out_timer, &svo_algo_timer);
+		data_out = new AsyncWriter(data_name, &svo_io_out_timer, &svo_algo_timer);
+	}
 
 	// Setup building variables
 	b_maxdepth = log2((unsigned int)gridlength);
-	b_buffers.resize(b_maxdepth + 1);
-	for (int i = 0; i < b_maxdepth + 1; i++){
-		b_buffers[i].reserve(8);
+	assert(b_maxdepth < MAX_OCTREE_LEVELS);
+	memset(b_buffer_size, 0, sizeof(b_buffer_size));
+	memset(b_buffer_mask, 0, sizeof(b_buffer_mask));
+
+	// Breadth-first: open a temporary node file for every level below the root
+	memset(level_out, 0, sizeof(level_out));
+	memset(level_pos, 0, sizeof(level_pos));
+	if (layout == LAYOUT_BREADTH){
+		for (int l = 1; l <= b_maxdepth; l++){
+			level_out[l] = fopen(levelFilename(l).c_str(), "w+b");
+			if (level_out[l] == NULL){
+				cout << "Error: could not open " << levelFilename(l) << " for writing." << endl;
+				exit(1);
+			}
+		}
+	}
+
+	// With a DAG table, identical children blocks are only written once
+	if (dag_entries > 0){
+		dag = new DagTable(dag_entries);
 	}
 
 	// Fill data arrays
 	b_max_morton = mortonEncode_LUT((unsigned int)gridlength - 1, (unsigned int)gridlength - 1, (unsigned int)gridlength - 1);
-	svo_algo_timer.stop(); svo_io_out_timer.start(); // TIMING
-	writeVoxelData(data_out, VoxelData(), b_data_pos); // first data point is NULL
+	writeVoxelData(*data_out, VoxelData(), b_data_pos); // first data point is NULL
 
     VoxelData v = VoxelData(0, vec3(), vec3(1.0, 1.0, 1.0)); // We store a simple white voxel in case of Binary voxelization
-	writeVoxelData(data_out, v, b_data_pos); // all leafs will refer to this
+	writeVoxelData(*data_out, v, b_data_pos); // all leafs will refer to this
 
-    svo_io_out_timer.stop(); svo_algo_timer.stop();
+	svo_algo_timer.stop();
 }
 
 // Finalize the tree: add rest of empty nodes, make sure root node is on top
-void OctreeBuilder::finalizeTree(){
+template <typename Payload>
+void OctreeBuilder<Payload>::finalizeTree(){
 	// fill octree
-	if (b_current_morton < b_max_morton){
+	if (b_current_morton <= b_max_morton){
 		fastAddEmpty((b_max_morton - b_current_morton) + 1);
 	}
 
 	// write root node
-	svo_algo_timer.stop(); svo_io_out_timer.start(); // TIMING
-	writeNode(node_out, b_buffers[0][0], b_node_pos);
-	svo_io_out_timer.stop(); svo_algo_timer.start(); // TIMING
+	Node<Payload> root = (b_buffer_mask[0] & 1) ? b_buffers[0][0] : Node<Payload>(); // an empty tree still gets a (null) root
+	OctreeInfo octree_info(1, base_filename, gridlength, 0, b_data_pos, format, dag != NULL);
+	if (format == FORMAT_ESVO){
+		writeDescriptorBlock(&root, 1, b_maxdepth == 1);
+	}
+	else if (layout == LAYOUT_BREADTH){
+		writeLevels(root, octree_info.level_offsets); // the node writer does the IO timing
+		octree_info.layout = LAYOUT_BREADTH;
+	}
+	else {
+		writeNode(*node_out, root, b_node_pos);
+	}
 
 	// write header
-	OctreeInfo octree_info(1, base_filename, gridlength, b_node_pos, b_data_pos);
+	octree_info.n_nodes = b_node_pos;
 
 	svo_algo_timer.stop(); svo_io_out_timer.start(); // TIMING
 	writeOctreeHeader(base_filename + string(".octree"), octree_info);
 	svo_io_out_timer.stop(); svo_algo_timer.start(); // TIMING
 
-	// close files
-	fclose(data_out);
-	fclose(node_out);
+	// close files: this waits for the writer threads to finish, or unmaps and truncates the files
+	data_out->close();
+	node_out->close();
+	if (verbose){
+		cout << "  background write time: " << node_out->write_seconds + data_out->write_seconds << " s." << endl;
+	}
+	delete data_out;
+	delete node_out;
+	if (dag){
+		if (verbose){
+			cout << "  dag: reused " << dag->reused_blocks << " children blocks, saving " << dag->reused_nodes << " nodes" << endl;
+		}
+		delete dag;
+		dag = NULL;
+	}
 }
 
-// Group 8 nodes, write non-empty nodes to disk and create parent node
-Node OctreeBuilder::groupNodes(const vector<Node> &buffer){
-	Node parent = Node();
-	bool first_stored_child = true;
-	for (int k = 0; k < 8; k++){
-		if (!buffer[k].isNull()){
-			if (first_stored_child){
-				svo_algo_timer.stop(); svo_io_out_timer.start(); // TIMING
-				parent.children_base = writeNode(node_out, buffer[k], b_node_pos);
-				svo_io_out_timer.stop(); svo_algo_timer.start(); // TIMING
-				parent.children_offset[k] = 0;
-				first_stored_child = false;
-			}
-			else {
-				svo_algo_timer.stop(); svo_io_out_timer.start(); // TIMING
-				parent.children_offset[k] = (char)(writeNode(node_out, buffer[k], b_node_pos) - parent.children_base);
-				svo_io_out_timer.stop(); svo_algo_timer.start(); // TIMING
-			}
-		}
-		else {
-			parent.children_offset[k] = NOCHILD;
-		}
+// Group 8 nodes on the given level, write non-empty nodes to disk and create parent node
+template <typename Payload>
+Node<Payload> OctreeBuilder<Payload>::groupNodes(const Node<Payload>* buffer, const unsigned char mask, const int level){
+	Node<Payload> parent = Node<Payload>();
+	parent.children_base = writeBlock(buffer, mask, level);
+	int rank = 0;
+	for (int k = 0; k < 8; k++){ // non-empty children are stored next to each other
+		parent.children_offset[k] = (mask & (1 << k)) ? (char)(rank++) : NOCHILD;
 	}
 
-	// SIMPLE LEVEL CONSTRUCTION
-	if (generate_levels){
-		VoxelData d = VoxelData();
-		float notnull = 0.0f;
+	// LEVEL CONSTRUCTION (only when nodes cache their data, compiled out for binary voxelization)
+	// Partition subtrees get their levels in a parallel pass (see parallel_builder.h), so this only runs for the levels above them
+	if (Payload::has_data && generate_levels){
+		VoxelData children[8];
+		size_t coverage[8];
+		size_t total = 0;
+		int notnull = 0;
 		for (int i = 0; i < 8; i++){ // this node has no data: need to refine
-			if (!buffer[i].isNull())
+			if (mask & (1 << i)){
+				children[notnull] = buffer[i].getCache();
+				coverage[notnull] = buffer[i].getCoverage();
+				total += coverage[notnull];
 				notnull++;
-			d.color += buffer[i].data_cache.color;
-			d.normal += buffer[i].data_cache.normal;
+			}
 		}
-		d.color = d.color / notnull;
-		vec3 tonormalize = (vec3)(d.normal / notnull);
-		d.normal = normalize(tonormalize);
+		VoxelData d = filterVoxelData(lod_filter, children, coverage, notnull);
 		// set it in the parent node
-		svo_algo_timer.stop(); svo_io_out_timer.start(); // TIMING
-		parent.data = writeVoxelData(data_out, d, b_data_pos);
-		svo_io_out_timer.stop(); svo_algo_timer.start(); // TIMING
-		parent.data_cache = d;
+		parent.data = writeVoxelData(*data_out, d, b_data_pos);
+		parent.setCache(d);
+		parent.setCoverage(total);
 	}
 
 	return parent;
 }
 
-// Add an empty datapoint at a certain buffer level, and refine upwards from there
-void OctreeBuilder::addEmptyVoxel(const int buffer){
-	b_buffers[buffer].push_back(Node());
-	refineBuffers(buffer);
-    b_current_morton = (mort_t)(b_current_morton + pow(8.0, b_maxdepth - buffer)); // because we're adding at a certain level
+// Write the non-empty nodes in a buffer (which are on the given level) as a children block, returns its base position.
+// When building a DAG, a block we've written before is reused instead.
+template <typename Payload>
+size_t OctreeBuilder<Payload>::writeBlock(const Node<Payload>* buffer, const unsigned char mask, const int level){
+	if (format == FORMAT_ESVO && level == b_maxdepth){
+		return 0; // leafs don't get a descriptor, they only show up in their parent's masks
+	}
+	DagBlock block;
+	block.level = (unsigned char)level;
+	if (dag){
+		for (int k = 0; k < 8; k++){
+			if (mask & (1 << k)){ block.add(buffer[k]); }
+		}
+		size_t pos;
+		if (dag->find(block, pos)){ return pos; }
+	}
+
+	size_t base = b_node_pos;
+	if (format == FORMAT_ESVO){
+		base = writeDescriptorBlock(buffer, mask, level + 1 == b_maxdepth);
+	}
+	else if (layout == LAYOUT_BREADTH){ // position within the file of this level
+		base = level_pos[level];
+		for (int k = 0; k < 8; k++){
+			if (mask & (1 << k)){ writeNode(level_out[level], buffer[k], level_pos[level]); }
+		}
+	}
+	else {
+		for (int k = 0; k < 8; k++){
+			if (mask & (1 << k)){ writeNode(*node_out, buffer[k], b_node_pos); }
+		}
+	}
+
+	if (dag){ dag->insert(block, base); }
+	return base;
+}
+
+// Write the ESVO child descriptors for the non-empty (non-leaf) nodes in a buffer, preceded by the far pointers they need.
+// The children_base of these nodes has to be the position of their own first child descriptor, unless leaf_children is set.
+// Returns the position of the first descriptor.
+template <typename Payload>
+size_t OctreeBuilder<Payload>::writeDescriptorBlock(const Node<Payload>* buffer, const unsigned char mask, const bool leaf_children){
+	// Find out which descriptors need a far pointer, assuming the worst case of 8 far pointers in front of them
+	const size_t start = b_node_pos;
+	bool far[8];
+	int n_far = 0;
+	int rank = 0;
+	for (int k = 0; k < 8; k++){
+		far[k] = false;
+		if (mask & (1 << k)){
+			far[k] = !leaf_children && (start + 8 + rank - buffer[k].children_base) > ESVO_MAX_POINTER;
+			if (far[k]){ n_far++; }
+			rank++;
+		}
+	}
+
+	// Far pointers first, then the descriptors
+	const size_t first = start + n_far;
+	int f = 0;
+	rank = 0;
+	for (int k = 0; k < 8; k++){
+		if (far[k]){
+			writeChildDescriptor(*node_out, (uint32_t)(start + f - buffer[k].children_base), b_node_pos);
+			f++;
+		}
+	}
+	f = 0;
+	for (int k = 0; k < 8; k++){
+		if (mask & (1 << k)){
+			const Node<Payload> &n = buffer[k];
+			unsigned char valid = 0;
+			for (int c = 0; c < 8; c++){
+				if (n.hasChild(c)){ valid |= (unsigned char)(1 << c); }
+			}
+			const size_t pos = first + rank;
+			size_t pointer = 0;
+			if (far[k]){ pointer = pos - (start + f); f++; }
+			else if (!leaf_children){ pointer = pos - n.children_base; }
+			writeChildDescriptor(*node_out, makeChildDescriptor(pointer, far[k], valid, leaf_children ? valid : 0), b_node_pos);
+			rank++;
+		}
+	}
+	return first;
+}
+
+// Write a subtree built with partition-local indices (see parallel_builder.h) block by block, through writeBlock.
+// The node stream is a sequence of children blocks in file order, every block is owned by the node that points to it.
+template <typename Payload>
+void OctreeBuilder<Payload>::writeSubtreeBlocks(PartitionSubtree<Payload> &subtree){
+	const vector< Node<Payload> > &nodes = subtree.nodes;
+	const size_t n = nodes.size();
+	if (n == 0 || subtree.root.isLeaf()){ return; }
+
+	// Find the children blocks: the size of the block owned by each node is its amount of children
+	vector<unsigned char> block_size(n, 0);
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)n; i++){
+		if (!nodes[i].isLeaf()){
+			unsigned char count = 0;
+			for (int c = 0; c < 8; c++){ if (nodes[i].hasChild(c)){ count++; } }
+			block_size[nodes[i].children_base] = count;
+		}
+	}
+	unsigned char root_count = 0;
+	for (int c = 0; c < 8; c++){ if (subtree.root.hasChild(c)){ root_count++; } }
+	block_size[subtree.root.children_base] = root_count;
+
+	// Write blocks in order, translating the children base of every node to the position its block got.
+	// Blocks below a node come before it, so we also know how far above the leafs every block is.
+	const size_t data_offset = b_data_pos - LOCAL_DATA_BASE;
+	writeVoxelDataArray(*data_out, subtree.data.empty() ? NULL : &subtree.data[0], subtree.data.size(), b_data_pos);
+	vector<size_t> block_pos(n, 0);
+	vector<unsigned char> height(n, 0);
+	Node<Payload> block[8];
+	for (size_t i = 0; i < n; i += block_size[i]){
+		assert(block_size[i] > 0);
+		const bool leaf_block = nodes[i].isLeaf();
+		height[i] = leaf_block ? 0 : (unsigned char)(height[nodes[i].children_base] + 1);
+		for (int c = 0; c < block_size[i]; c++){
+			block[c] = nodes[i + c];
+			rebaseNode(block[c], 0, data_offset);
+			if (!leaf_block){ block[c].children_base = block_pos[block[c].children_base]; }
+		}
+		block_pos[i] = writeBlock(block, (unsigned char)((1 << block_size[i]) - 1), b_maxdepth - height[i]);
+	}
+	rebaseNode(subtree.root, 0, data_offset);
+	subtree.root.children_base = block_pos[subtree.root.children_base];
+}
+
+// Name of the temporary node file for a level, in the breadth-first layout
+template <typename Payload>
+string OctreeBuilder<Payload>::levelFilename(const int level) const{
+	stringstream name;
+	name << base_filename << ".octreenodes.level" << level;
+	return name.str();
+}
+
+// Write the breadth-first node file: the root, followed by the level files from the top down.
+// A node's children are on the next level, so their address becomes absolute by adding where that level starts.
+// The level files are streamed through once and removed, so this works out-of-core too.
+template <typename Payload>
+void OctreeBuilder<Payload>::writeLevels(Node<Payload> root, vector<size_t> &level_offsets){
+	level_offsets.assign(b_maxdepth + 1, 0);
+	for (int l = 1; l <= b_maxdepth; l++){
+		level_offsets[l] = level_offsets[l - 1] + ((l == 1) ? 1 : level_pos[l - 1]);
+	}
+	if (!root.isLeaf() && b_maxdepth > 0){ root.children_base += level_offsets[1]; }
+	writeNode(*node_out, root, b_node_pos);
+	for (int l = 1; l <= b_maxdepth; l++){
+		FILE* f = level_out[l];
+		rewind(f); // also flushes what we wrote
+		Node<Payload> n;
+		for (size_t i = 0; i < level_pos[l]; i++){
+			readNode(f, n);
+			if (!n.isLeaf()){ n.children_base += level_offsets[l + 1]; }
+			writeNode(*node_out, n, b_node_pos);
+		}
+		fclose(f);
+		level_out[l] = NULL;
+		remove(levelFilename(l).c_str());
+	}
 }
 
 // REFINE BUFFERS: check all levels from start_depth up and group 8 nodes on a higher level
-void OctreeBuilder::refineBuffers(const int start_depth){
-	for (int d = start_depth; d >= 0; d--){
-		if (b_buffers[d].size() == 8){ // if we have 8 nodes
-			assert(d - 1 >= 0);
-			if (isBufferEmpty(b_buffers[d])){
-				b_buffers[d - 1].push_back(Node()); // push back NULL node to represent 8 empty nodes
-			}
-			else {
-				b_buffers[d - 1].push_back(groupNodes(b_buffers[d])); // push back parent node
-			}
-			b_buffers.at(d).clear(); // clear the 8 nodes on this level
+template <typename Payload>
+void OctreeBuilder<Payload>::refineBuffers(const int start_depth){
+	for (int d = start_depth; d > 0 && b_buffer_size[d] == 8; d--){ // if we have 8 nodes
+		if (b_buffer_mask[d] == 0){
+			b_buffer_size[d - 1]++; // push back NULL node to represent 8 empty nodes
 		}
 		else {
-			break; // break the for loop: no upper levels will need changing
+			addNode(d - 1, groupNodes(b_buffers[d], b_buffer_mask[d], d)); // push back parent node
 		}
+		b_buffer_size[d] = 0; // clear the 8 nodes on this level
+		b_buffer_mask[d] = 0;
 	}
 }
 
 // Add a datapoint to the octree: this is the main method used to push datapoints
-void OctreeBuilder::addVoxel(const mort_t morton_number){
+template <typename Payload>
+void OctreeBuilder<Payload>::addVoxel(const mort_t morton_number){
 	// Padding for missed morton numbers
 	if (morton_number != b_current_morton){
 		fastAddEmpty(morton_number - b_current_morton);
 	}
 
 	// Create node
-	Node node = Node(); // create empty node
+	Node<Payload> node = Node<Payload>(); // create empty node
 	node.data = 1; // all nodes in binary voxelization refer to this
 	// Add to buffer
-	b_buffers.at(b_maxdepth).push_back(node);
+	addNode(b_maxdepth, node);
 	// Refine buffers
 	refineBuffers(b_maxdepth);
 
@@ -145,23 +334,26 @@ void OctreeBuilder::addVoxel(const mort_t morton_number){
 }
 
 // Add a datapoint to the octree: this is the main method used to push datapoints
-void OctreeBuilder::addVoxel(const VoxelData& data){
+template <typename Payload>
+void OctreeBuilder<Payload>::addVoxel(const VoxelData& data){
 	// Padding for missed morton numbers
 	if (data.morton != b_current_morton){
 		fastAddEmpty(data.morton - b_current_morton);
 	}
 
 	// Create node
-	Node node = Node(); // create empty node
+	Node<Payload> node = Node<Payload>(); // create empty node
 	// Write data point
-	svo_algo_timer.stop(); svo_io_out_timer.start(); // TIMING
-	node.data = writeVoxelData(data_out, data, b_data_pos); // store data
-	svo_io_out_timer.stop(); svo_algo_timer.start(); // TIMING
-	node.data_cache = data; // store data as cache
+	node.data = writeVoxelData(*data_out, data, b_data_pos); // store data
+	node.setCache(data); // store data as cache
 	// Add to buffers
-	b_buffers.at(b_maxdepth).push_back(node);
+	addNode(b_maxdepth, node);
 	// Refine buffers
 	refineBuffers(b_maxdepth);
 
 	b_current_morton++;
 }
+
+// Both payload flavours live in the same executable
+template class OctreeBuilder<BinaryPayload>;
+template class OctreeBuilder<VoxelPayload>;
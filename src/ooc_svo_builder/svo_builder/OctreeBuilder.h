@@ -3,19 +3,32 @@
 
 #include <stdio.h>
 #include <fstream>
+#include <sstream>
 #include <assert.h>
 #include <tri_util.h>
 #include "globals.h"
 #include "svo_builder_util.h"
 #include "octree_io.h"
+#include "parallel_builder.h"
+#include "DagTable.h"
+#include "AsyncWriter.h"
+#include "MappedWriter.h"
 
 using namespace std;
 using namespace trimesh;
 
+// Maximum number of octree levels: 64-bit morton codes allow a grid of 2^21 voxels per side
+#define MAX_OCTREE_LEVELS 22
+
 // Octreebuilder class. You pass this class DataPoints, it builds an octree from them.
+// The Payload policy (see Node.h) decides whether nodes cache voxel data for level refinement.
+template <typename Payload>
 class OctreeBuilder {
 public:
-	vector< vector< Node > > b_buffers;
+	// Per-level child stacks: nodes are only stored for non-empty children, empty children just advance the count
+	Node<Payload> b_buffers[MAX_OCTREE_LEVELS][8];
+	unsigned char b_buffer_size[MAX_OCTREE_LEVELS]; // amount of children (empty or not) on this level
+	unsigned char b_buffer_mask[MAX_OCTREE_LEVELS]; // bit k is set if child k on this level is non-empty
 	size_t gridlength;
 	int b_maxdepth; // maximum octree depth
     mort_t b_current_morton; // current morton position
@@ -25,69 +38,124 @@ public:
 
 	// configuration
 	bool generate_levels; // switch to enable basic generation of higher octree levels
+	LodFilter lod_filter; // how higher octree levels are filtered from the levels below
+	OctreeFormat format; // node file layout: standard nodes or ESVO child descriptors
+	OctreeLayout layout; // node order: depth-first, or level by level
+	DagTable* dag; // when building a DAG: the children blocks we can reuse (NULL otherwise)
 
-	FILE* node_out;
-	FILE* data_out;
+	FileWriter* node_out; // nodes and data are written out by background threads, or through a file mapping
+	FileWriter* data_out;
 	string base_filename;
 
-	OctreeBuilder(std::string base_filename, size_t gridlength, bool generate_levels);
+	// Breadth-first layout: every level (except the root) goes to its own temporary file, with children addresses
+	// relative to the file of the level below. They are glued together behind the root when the tree is finished.
+	FILE* level_out[MAX_OCTREE_LEVELS];
+	size_t level_pos[MAX_OCTREE_LEVELS]; // current node position in each level file
+
+	OctreeBuilder(std::string base_filename, size_t gridlength, bool generate_levels, LodFilter lod_filter = LOD_BOX, OctreeFormat format = FORMAT_STANDARD,
+		OctreeLayout layout = LAYOUT_DEPTH, size_t dag_entries = 0, bool mapped_output = false);
 	void finalizeTree();
     void addVoxel(const mort_t morton_number);
 	void addVoxel(const VoxelData& point);
+	void addSubtree(PartitionSubtree<Payload> &subtree, const int depth);
 
 private:
 	// helper methods for octree building
 	void fastAddEmpty(const size_t budget);
-	void addEmptyVoxel(const int buffer);
-	bool isBufferEmpty(const vector<Node> &buffer);
+	void addEmptyNodes(const int level, const int count);
+	void addNode(const int level, const Node<Payload> &node);
 	void refineBuffers(const int start_depth);
-	Node groupNodes(const vector<Node> &buffer);
-	int highestNonEmptyBuffer();
-	int computeBestFillBuffer(const size_t budget);
+	Node<Payload> groupNodes(const Node<Payload>* buffer, const unsigned char mask, const int level);
+	size_t writeBlock(const Node<Payload>* buffer, const unsigned char mask, const int level);
+	size_t writeDescriptorBlock(const Node<Payload>* buffer, const unsigned char mask, const bool leaf_children);
+	void writeSubtreeBlocks(PartitionSubtree<Payload> &subtree);
+	string levelFilename(const int level) const;
+	void writeLevels(Node<Payload> root, vector<size_t> &level_offsets);
 };
 
-// Check if a buffer contains non-empty nodes
-inline bool OctreeBuilder::isBufferEmpty(const vector<Node> &buffer){
-	for(int k = 0; k<8; k++){
-		if(!buffer[k].isNull()){
-			return false;
-		}
-	}
-	return true;
+// Push a non-empty node on a buffer level
+template <typename Payload>
+inline void OctreeBuilder<Payload>::addNode(const int level, const Node<Payload> &node){
+	b_buffers[level][b_buffer_size[level]] = node;
+	b_buffer_mask[level] |= (unsigned char)(1 << b_buffer_size[level]);
+	b_buffer_size[level]++;
 }
 
-// Find the highest non empty buffer, return its index
-inline int OctreeBuilder::highestNonEmptyBuffer(){
-	int highest_found = b_maxdepth; // highest means "lower in buffer id" here.
-	for(int k = b_maxdepth; k>=0; k--){
-		if(b_buffers[k].size() == 0){ // this buffer level is empty
-			highest_found--;
-		} else { // this buffer level is nonempty: break
-			return highest_found;
+// Push a run of empty nodes on a buffer level (count must fit in the buffer), and refine upwards from there
+template <typename Payload>
+inline void OctreeBuilder<Payload>::addEmptyNodes(const int level, const int count){
+	b_buffer_size[level] = (unsigned char)(b_buffer_size[level] + count);
+	refineBuffers(level);
+	b_current_morton += (mort_t)count << (3 * (b_maxdepth - level)); // because we're adding at a certain level
+}
+
+// A method to quickly add empty nodes: instead of adding them one by one, we add whole runs of them on the highest
+// levels possible. First climb up, completing partially filled buffers, then descend to the target position.
+template <typename Payload>
+inline void OctreeBuilder<Payload>::fastAddEmpty(const size_t budget){
+	const mort_t target = b_current_morton + budget;
+	int level = b_maxdepth;
+	for (; level > 0; level--){
+		const int shift = 3 * (b_maxdepth - level);
+		if ((b_current_morton >> (shift + 3)) == (target >> (shift + 3))){
+			break; // remaining run falls under the same parent: no need to climb further
+		}
+		addEmptyNodes(level, 8 - b_buffer_size[level]);
+	}
+	for (; level <= b_maxdepth; level++){
+		const int shift = 3 * (b_maxdepth - level);
+		const int count = (int)((target >> shift) & 7) - (int)((b_current_morton >> shift) & 7);
+		if (count > 0){
+			addEmptyNodes(level, count);
 		}
 	}
-	return highest_found;
 }
 
-// Compute the best fill buffer given the budget
-inline int OctreeBuilder::computeBestFillBuffer(const size_t budget){
-	// which power of 8 fits in budget?
-	int budget_buffer_suggestion = b_maxdepth-findPowerOf8(budget);
-	// if our current guess is already b_maxdepth, return that, no need to test further
-	if(budget_buffer_suggestion == b_maxdepth){return b_maxdepth;}
-	// best fill buffer is maximum of suggestion and highest non_empty buffer
-	return max(budget_buffer_suggestion, highestNonEmptyBuffer());
-}
+// Merge a complete subtree of the given depth, built independently with partition-local indices (see parallel_builder.h).
+// Its node and data streams are rebased and appended to the output, its root is then handed to the serial upper levels.
+template <typename Payload>
+void OctreeBuilder<Payload>::addSubtree(PartitionSubtree<Payload> &subtree, const int depth){
+	if (subtree.root.isNull()){ return; } // nothing to add, the padding will happen when the next voxel comes in
+
+	// Padding for missed morton numbers
+	if (subtree.morton_start != b_current_morton){
+		fastAddEmpty(subtree.morton_start - b_current_morton);
+	}
 
-// A method to quickly add empty nodes
-inline void OctreeBuilder::fastAddEmpty(const size_t budget){
-	size_t r_budget = budget;
-	while (r_budget > 0){
-		unsigned int buffer = computeBestFillBuffer(r_budget);
-		addEmptyVoxel(buffer);
-		size_t budget_hit = (size_t) pow(8.0,b_maxdepth-buffer);
-		r_budget = r_budget - budget_hit;
+	// Rebase the subtree onto the current output positions and write it out
+	if (format == FORMAT_ESVO || dag || layout == LAYOUT_BREADTH){ // every block needs to be re-encoded, looked up or placed on its level
+		writeSubtreeBlocks(subtree);
 	}
+	else {
+		const size_t node_offset = b_node_pos;
+		const size_t data_offset = b_data_pos - LOCAL_DATA_BASE;
+		const size_t n = subtree.nodes.size();
+		writeVoxelDataArray(*data_out, subtree.data.empty() ? NULL : &subtree.data[0], subtree.data.size(), b_data_pos);
+		char* out = (n > 0) ? node_out->reserve(n * NODE_FILE_SIZE) : NULL;
+		if (out){ // mapped output: every thread rebases its nodes straight into their place in the file
+#pragma omp parallel for
+			for (long long i = 0; i < (long long)n; i++){
+				Node<Payload> node = subtree.nodes[i];
+				rebaseNode(node, node_offset, data_offset);
+				memcpy(out + i * NODE_FILE_SIZE, &node.data, NODE_FILE_SIZE);
+			}
+			b_node_pos += n;
+		}
+		else {
+#pragma omp parallel for
+			for (long long i = 0; i < (long long)n; i++){
+				rebaseNode(subtree.nodes[i], node_offset, data_offset);
+			}
+			writeNodes(*node_out, n == 0 ? NULL : &subtree.nodes[0], n, b_node_pos);
+		}
+		rebaseNode(subtree.root, node_offset, data_offset);
+	}
+
+	// Add subtree root to its buffer level and refine upwards from there
+	int level = b_maxdepth - depth;
+	addNode(level, subtree.root);
+	refineBuffers(level);
+	b_current_morton = subtree.morton_start + ((mort_t)1 << (3 * depth));
 }
 
 #endif // OCTREE_BUILDER_H_
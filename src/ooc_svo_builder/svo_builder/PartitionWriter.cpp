@@ -0,0 +1,129 @@
+#include "PartitionWriter.h"
+#include <omp.h>
+#include <file_tools.h>
+
+// Start the writer threads
+PartitionWriter::PartitionWriter(const size_t n_threads, const size_t max_queued) :
+bytes_written(0), write_seconds(0), failed_writes(0), next_worker(0), queued(0), max_queued(max_queued), done(false) {
+	workers.resize(max((size_t)1, n_threads));
+	for (size_t i = 0; i < workers.size(); i++){
+		workers[i] = new Worker();
+		workers[i]->t = thread(&PartitionWriter::workerLoop, this, workers[i]);
+	}
+}
+
+PartitionWriter::~PartitionWriter(){
+	finish();
+}
+
+// Hand a block of triangles over, to be written at the given byte position in the file. The triangles get swapped
+// with an empty block (with the capacity of an earlier one, if there is one), so the caller can go on filling it.
+void PartitionWriter::submit(FILE* file, const size_t offset, vector<Triangle> &triangles){
+	Job job;
+	job.file = file;
+	job.offset = offset;
+	job.close_file = false;
+	const size_t bytes = triangles.size() * sizeof(Triangle);
+	unique_lock<mutex> l(lock);
+	job.triangles.swap(triangles);
+	if (!spare_blocks.empty()){
+		triangles.swap(spare_blocks.back());
+		spare_blocks.pop_back();
+	}
+	enqueue(l, job, bytes);
+}
+
+// Close a file, once all of its blocks have been written
+void PartitionWriter::close(FILE* file){
+	Job job;
+	job.file = file;
+	job.offset = 0;
+	job.close_file = true;
+	unique_lock<mutex> l(lock);
+	enqueue(l, job, 0);
+}
+
+// Queue a job on the worker of its file (we hold the lock), waiting while too much is queued already
+void PartitionWriter::enqueue(unique_lock<mutex> &l, Job &job, const size_t bytes){
+	while (queued > 0 && queued + bytes > max_queued){
+		job_done.wait(l);
+	}
+	map<FILE*, size_t>::iterator it = file_worker.find(job.file);
+	if (it == file_worker.end()){
+		it = file_worker.insert(make_pair(job.file, next_worker)).first;
+		next_worker = (next_worker + 1) % workers.size();
+	}
+	Worker* w = workers[it->second];
+	if (job.close_file){
+		file_worker.erase(it);
+	}
+	queued += bytes;
+	w->jobs.push_back(Job());
+	w->jobs.back().file = job.file;
+	w->jobs.back().offset = job.offset;
+	w->jobs.back().close_file = job.close_file;
+	w->jobs.back().triangles.swap(job.triangles);
+	w->job_added.notify_one();
+}
+
+// Write out everything that's left and stop the writer threads
+void PartitionWriter::finish(){
+	{
+		unique_lock<mutex> l(lock);
+		if (done){ return; }
+		done = true;
+		for (size_t i = 0; i < workers.size(); i++){
+			workers[i]->job_added.notify_one();
+		}
+	}
+	for (size_t i = 0; i < workers.size(); i++){
+		workers[i]->t.join();
+		delete workers[i];
+	}
+	workers.clear();
+	spare_blocks.clear();
+}
+
+// Writer thread: write the blocks of its files in order, until we're done and nothing is left
+void PartitionWriter::workerLoop(Worker* w){
+	while (true){
+		Job job;
+		{
+			unique_lock<mutex> l(lock);
+			while (w->jobs.empty() && !done){
+				w->job_added.wait(l);
+			}
+			if (w->jobs.empty()){ return; } // done, and nothing left to write
+			job.file = w->jobs.front().file;
+			job.offset = w->jobs.front().offset;
+			job.close_file = w->jobs.front().close_file;
+			job.triangles.swap(w->jobs.front().triangles);
+			w->jobs.pop_front();
+		}
+		const size_t bytes = job.triangles.size() * sizeof(Triangle);
+		double start = omp_get_wtime();
+		bool failed = false;
+		if (bytes > 0 && (seek_file(job.file, job.offset) != 0 || fwrite(&job.triangles[0], sizeof(Triangle), job.triangles.size(), job.file) != job.triangles.size())){
+			cout << "Error: writing " << job.triangles.size() << " triangles to a partition file failed." << endl;
+			failed = true;
+		}
+		if (job.close_file && fclose(job.file) != 0){ // the last of what we wrote only gets flushed here
+			cout << "Error: closing a partition file failed." << endl;
+			failed = true;
+		}
+		const double seconds = omp_get_wtime() - start;
+		{
+			unique_lock<mutex> l(lock);
+			if (failed){ failed_writes++; }
+			queued -= bytes;
+			bytes_written += bytes;
+			write_seconds += seconds;
+			if (job.triangles.capacity() > 0){
+				job.triangles.clear();
+				spare_blocks.push_back(vector<Triangle>());
+				spare_blocks.back().swap(job.triangles);
+			}
+			job_done.notify_all();
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef PARTITION_WRITER_H_
+#define PARTITION_WRITER_H_
+
+#include <stdio.h>
+#include <vector>
+#include <deque>
+#include <map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <tri_tools.h>
+
+using namespace std;
+using namespace trimesh;
+
+// Writer threads for the partition files, and how much they may have queued (in bytes) before a Buffer has to wait
+#define PARTITION_WRITER_THREADS 2
+#define PARTITION_WRITER_QUEUED (64 * 1024 * 1024)
+// Memory for the blocks all Buffers fill up together (in bytes), and the granularity of a block (in triangles: 512 triangles are 5 pages)
+#define PARTITION_WRITER_MEMORY (128 * 1024 * 1024)
+#define PARTITION_WRITER_BLOCK_ALIGN 512
+// Largest block a Buffer fills before handing it over (in triangles)
+#define PARTITION_WRITER_MAX_BLOCK 65536
+
+// Size (in triangles) of the block every Buffer fills before handing it to the writer: as large as the memory for blocks allows
+// with this many partitions, never below the given minimum. Blocks are whole pages, so the writes to a partition file stay page-aligned.
+inline size_t partitionBlockSize(const size_t n_partitions, const size_t min_block){
+	size_t block = PARTITION_WRITER_MEMORY / (n_partitions * TRIANGLE_SIZE * sizeof(float));
+	block = min(block, (size_t)PARTITION_WRITER_MAX_BLOCK);
+	block -= block % PARTITION_WRITER_BLOCK_ALIGN;
+	return max(block, min_block);
+}
+
+// Background writer for the partition files. Buffers hand over their full blocks of triangles, which get written by a small pool
+// of threads, so binning only waits when the disk can't keep up. A file always goes to the same thread, so its blocks are written
+// in order, and it's closed by that thread once everything is in. Blocks go back to the Buffers afterwards, to be filled again.
+class PartitionWriter {
+public:
+	size_t bytes_written; // total amount of bytes written to the partition files
+	double write_seconds; // time the writer threads spent writing them
+	size_t failed_writes; // blocks that could not be written (or files that could not be closed): the partitions are incomplete
+
+	PartitionWriter(const size_t n_threads = PARTITION_WRITER_THREADS, const size_t max_queued = PARTITION_WRITER_QUEUED);
+	~PartitionWriter();
+
+	void submit(FILE* file, const size_t offset, vector<Triangle> &triangles);
+	void close(FILE* file);
+	void finish();
+
+private:
+	struct Job {
+		FILE* file;
+		size_t offset; // byte position of the block in the file
+		vector<Triangle> triangles;
+		bool close_file; // close the file after this block (which may be empty)
+	};
+	struct Worker {
+		deque<Job> jobs;
+		condition_variable job_added;
+		thread t;
+	};
+
+	vector<Worker*> workers;
+	map<FILE*, size_t> file_worker; // the worker every open file is written by
+	size_t next_worker;
+	vector< vector<Triangle> > spare_blocks; // written blocks, which keep their capacity
+	size_t queued; // bytes waiting to be written
+	size_t max_queued;
+	bool done;
+	mutex lock;
+	condition_variable job_done;
+
+	void enqueue(unique_lock<mutex> &l, Job &job, const size_t bytes);
+	void workerLoop(Worker* w);
+};
+
+#endif // PARTITION_WRITER_H_
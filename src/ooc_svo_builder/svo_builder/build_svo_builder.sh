@@ -4,10 +4,9 @@
 TRIMESH_DIR=/home/jeroen/development/trimesh2
 
 ## COMPILE AND LINK DEFINITIONS
+## Binary and payload voxelization are both in this build, selected at runtime with -payload
 COMPILE="g++ -g -c -O3 -I../tri_tools/include/ -I ${TRIMESH_DIR}/include/"
-COMPILE_BINARY="g++ -c -O3 -I../tri_tools/include/ -I ${TRIMESH_DIR}/include/ -D BINARY_VOXELIZATION"
 LINK="g++ -g -o svo_builder"
-LINK_BINARY="g++ -g -o svo_builder_binary"
 
 #############################################################################################
 ## BUILDING STARTS HERE
@@ -15,28 +14,19 @@ LINK_BINARY="g++ -g -o svo_builder_binary"
 ## CLEAN
 echo "Removing old versions ..."
 rm svo_builder
-rm svo_builder_binary
 rm *.o
 
-## BUILD BINARY VOXELIZATION VERSION
-echo "Compiling binary voxelization build..."
-${COMPILE_BINARY} main.cpp
-${COMPILE_BINARY} OctreeBuilder.cpp
-${COMPILE_BINARY} partitioner.cpp
-${COMPILE_BINARY} voxelizer.cpp
-echo "Linking binary voxelization build..."
-${LINK_BINARY} *.o
-
-echo "Cleaning up ..."
-rm *.o
-
-## BUILD REGULAR VERSION
-echo "Compiling regular version build..."
+## BUILD
+echo "Compiling ..."
 ${COMPILE} main.cpp
 ${COMPILE} OctreeBuilder.cpp
+${COMPILE} AsyncWriter.cpp
+${COMPILE} MappedWriter.cpp
+${COMPILE} PartitionWriter.cpp
+${COMPILE} memory_model.cpp
 ${COMPILE} partitioner.cpp
 ${COMPILE} voxelizer.cpp
-echo "Linking regular version build..."
+echo "Linking ..."
 ${LINK} *.o
 
 echo "Done"
@@ -0,0 +1,76 @@
+#ifndef LOD_FILTER_H_
+#define LOD_FILTER_H_
+
+#include "VoxelData.h"
+
+using namespace std;
+
+// Filters to generate the voxel data of intermediary octree levels (-levels) from the level below
+enum LodFilter {
+	LOD_BOX, // plain average of the children
+	LOD_NORMAL_CONE, // children weighted by how well their normal lines up with the average normal, to keep colors from bleeding over sharp edges
+	LOD_COVERAGE // children weighted by the amount of leaf voxels they cover
+};
+
+// Parse a filter name, returns false if we don't know it
+inline bool parseLodFilter(const string &name, LodFilter &filter){
+	if (name == "box") { filter = LOD_BOX; }
+	else if (name == "cone") { filter = LOD_NORMAL_CONE; }
+	else if (name == "coverage") { filter = LOD_COVERAGE; }
+	else { return false; }
+	return true;
+}
+
+inline const char* lodFilterName(const LodFilter filter){
+	switch (filter){
+	case LOD_NORMAL_CONE: return "cone";
+	case LOD_COVERAGE: return "coverage";
+	default: return "box";
+	}
+}
+
+// Filter the data of a parent node from the data of its n non-empty children.
+// coverage[i] is the amount of leaf voxels below child i (only used by the coverage filter).
+inline VoxelData filterVoxelData(const LodFilter filter, const VoxelData* children, const size_t* coverage, const int n){
+	VoxelData d = VoxelData();
+	if (n == 0){ return d; } // nothing to filter
+
+	vec3 color = vec3(), normal = vec3();
+	if (filter == LOD_BOX){
+		for (int i = 0; i < n; i++){
+			color += children[i].color;
+			normal += children[i].normal;
+		}
+		const float notnull = (float)n;
+		d.color = color / notnull;
+		vec3 tonormalize = (vec3)(normal / notnull);
+		d.normal = normalize(tonormalize);
+		return d;
+	}
+
+	float weights[8];
+	float total = 0.0f;
+	if (filter == LOD_COVERAGE){
+		for (int i = 0; i < n; i++){ weights[i] = (float)coverage[i]; }
+	}
+	else { // LOD_NORMAL_CONE: weight by the cosine between child normal and the cone axis
+		vec3 axis = vec3();
+		for (int i = 0; i < n; i++){ axis += children[i].normal; }
+		normalize(axis);
+		for (int i = 0; i < n; i++){ weights[i] = max(0.0f, children[i].normal DOT axis); }
+	}
+	for (int i = 0; i < n; i++){ total += weights[i]; }
+	if (total <= 0.0f){ // degenerate weights: all children count the same
+		for (int i = 0; i < n; i++){ weights[i] = 1.0f; }
+		total = (float)n;
+	}
+	for (int i = 0; i < n; i++){
+		color += weights[i] * children[i].color;
+		normal += weights[i] * children[i].normal;
+	}
+	d.color = color / total;
+	d.normal = normalize(normal);
+	return d;
+}
+
+#endif // LOD_FILTER_H_
@@ -11,6 +11,7 @@
 #include "voxelizer.h"
 #include "OctreeBuilder.h"
 #include "partitioner.h"
+#include "memory_model.h"
 
 using namespace std;
 
@@ -27,6 +28,21 @@ float sparseness_limit = 0.10f;
 ColorType color = COLOR_FROM_MODEL;
 vec3 fixed_color = vec3(1.0f, 1.0f, 1.0f); // fixed color is white
 bool generate_levels = false;
+LodFilter lod_filter = LOD_BOX;
+bool payload = false; // build nodes with their own voxel payload instead of binary voxelization
+OctreeFormat octree_format = FORMAT_STANDARD;
+OctreeLayout octree_layout = LAYOUT_DEPTH;
+bool build_dag = false; // merge identical subtrees into a sparse voxel DAG
+bool mapped_output = false; // write the octree files through memory mappings of preallocated files
+bool mapped_input = false; // map the source and partition triangles read-only, instead of reading them
+bool trip_container = false; // store all partitions in one .tripdata file instead of one file per partition
+bool adaptive_partitioning = false; // cut the morton order into partitions of balanced triangle density instead of equal ones
+bool autotune_config = false; // pick partition count, side buffer and threads from the memory model, within the memory limit
+size_t subtree_memory = 0; // memory for the subtrees of a batch under construction, in bytes (0: the memory limit)
+bool partition_cache = false; // keep the partitions after the build, and reuse them when they're still valid
+bool partition_in_core = false; // keep the partitions in memory, as lists of source triangles, instead of writing them to disk
+bool partition_index_files = false; // partition files only hold the indices of their source triangles, not the triangles
+bool read_ahead = false; // stream the source triangles through a read-ahead thread while partitioning, instead of reading them all first
 bool verbose = false;
 
 // trip header info
@@ -52,7 +68,7 @@ Timer svo_algo_timer;
 void printInfo() {
 	cout << "--------------------------------------------------------------------" << endl;
 
-    cout << "Out-Of-Core SVO Builder " << version << " - Geometry only version" << endl;
+    cout << "Out-Of-Core SVO Builder " << version << endl;
 
 #if defined(_WIN32) || defined(_WIN64)
 	cout << "Windows " << endl;
@@ -75,7 +91,21 @@ void printHelp() {
 	std::cout << "-f <filename.tri>     Path to a .tri input file." << endl;
 	std::cout << "-s <gridsize>         Voxel gridsize, should be a power of 2. Default 512." << endl;
 	std::cout << "-l <memory_limit>     Memory limit for process, in Mb. Default 1024." << endl;
-	std::cout << "-levels               Generate intermediary voxel levels by averaging voxel data" << endl;
+	std::cout << "-payload              Give every voxel its own payload instead of doing binary voxelization" << endl;
+	std::cout << "-levels               Generate intermediary voxel levels by averaging voxel data (payload only)" << endl;
+	std::cout << "-lod <box|cone|coverage> Filter used to generate intermediary voxel levels (default: box)" << endl;
+	std::cout << "-esvo                 Write nodes as compact 32-bit ESVO child descriptors (binary only)" << endl;
+	std::cout << "-dag                  Merge identical subtrees into a sparse voxel DAG (binary only)" << endl;
+	std::cout << "-layout <depth|breadth> Order of the nodes: depth-first with the root last (default), or level by level" << endl;
+	std::cout << "-mmap                 Write output files through memory mappings of preallocated files (not on Windows)" << endl;
+	std::cout << "-mmapin               Map the source and partition triangles read-only instead of reading them (not on Windows)" << endl;
+	std::cout << "-container            Store all partitions in one temporary .tripdata file instead of one file each" << endl;
+	std::cout << "-adaptive             Partition by estimated voxelization cost: variable-length morton ranges instead of equal ones" << endl;
+	std::cout << "-autotune             Pick partition count, side buffer (-d) and thread count to fit the whole run in the memory limit" << endl;
+	std::cout << "-cache                Keep the partitions for the next build of this model at this size, reuse them if they're there" << endl;
+	std::cout << "-incore               Keep the partitions in memory as lists of triangle indices, instead of in .tripdata files" << endl;
+	std::cout << "-indexfiles           Write just the (4-byte) indices of the triangles to the .tripdata files, instead of the triangles" << endl;
+	std::cout << "-readahead            Stream the source triangles through a read-ahead thread while partitioning, instead of reading them all first" << endl;
 	std::cout << "-c <option>           Coloring of voxels (Options: model (default), fixed, linear, normal)" << endl;
 	std::cout << "-d <percentage>		Percentage of memory limit to be used additionaly for sparseness optimization" << endl;
 	std::cout << "-v                    Be very verbose." << endl;
@@ -143,11 +173,81 @@ void parseProgramParameters(int argc, char* argv[]) {
 		else if (string(argv[i]) == "-levels") {
 			generate_levels = true;
 		}
+		else if (string(argv[i]) == "-lod") {
+			if (!parseLodFilter(string(argv[i + 1]), lod_filter)) {
+				cout << "Unrecognized LOD filter: " << argv[i + 1] << ", so reverting to box filter." << endl;
+			}
+			i++;
+		}
+		else if (string(argv[i]) == "-payload") {
+			payload = true;
+		}
+		else if (string(argv[i]) == "-esvo") {
+			octree_format = FORMAT_ESVO;
+		}
+		else if (string(argv[i]) == "-dag") {
+			build_dag = true;
+		}
+		else if (string(argv[i]) == "-layout") {
+			string layout_input = string(argv[i + 1]);
+			if (layout_input == "depth") {
+				octree_layout = LAYOUT_DEPTH;
+			}
+			else if (layout_input == "breadth") {
+				octree_layout = LAYOUT_BREADTH;
+			}
+			else {
+				cout << "Unrecognized layout: " << layout_input << ", so reverting to depth-first." << endl;
+			}
+			i++;
+		}
+		else if (string(argv[i]) == "-mmap") {
+			mapped_output = true;
+		}
+		else if (string(argv[i]) == "-mmapin") {
+			mapped_input = true;
+		}
+		else if (string(argv[i]) == "-container") {
+			trip_container = true;
+		}
+		else if (string(argv[i]) == "-adaptive") {
+			adaptive_partitioning = true;
+		}
+		else if (string(argv[i]) == "-autotune") {
+			autotune_config = true;
+		}
+		else if (string(argv[i]) == "-cache") {
+			partition_cache = true;
+		}
+		else if (string(argv[i]) == "-incore") {
+			partition_in_core = true;
+		}
+		else if (string(argv[i]) == "-indexfiles") {
+			partition_index_files = true;
+		}
+		else if (string(argv[i]) == "-readahead") {
+			read_ahead = true;
+		}
 		else if (string(argv[i]) == "-c") {
 			string color_input = string(argv[i + 1]);
-
-            cout << "You asked to generate colors, but we're only doing binary voxelisation." << endl;
-
+			if (color_input == "model") {
+				color = COLOR_FROM_MODEL;
+			}
+			else if (color_input == "linear") {
+				color = COLOR_LINEAR;
+				color_s = "Linear";
+			}
+			else if (color_input == "normal") {
+				color = COLOR_NORMAL;
+				color_s = "Normal";
+			}
+			else if (color_input == "fixed") {
+				color = COLOR_FIXED;
+				color_s = "Fixed";
+			}
+			else {
+				cout << "Unrecognized color switch: " << color_input << ", so reverting to colors from model." << endl;
+			}
 			i++;
 		}
 		else if (string(argv[i]) == "-h") {
@@ -157,13 +257,70 @@ void parseProgramParameters(int argc, char* argv[]) {
 			printInvalid(); exit(0);
 		}
 	}
+	if (!payload && color != COLOR_FROM_MODEL) {
+		cout << "You asked to generate colors, but we're only doing binary voxelisation." << endl;
+	}
+	if (!payload && generate_levels) {
+		cout << "Binary voxelization has no voxel payload to generate levels from, ignoring -levels." << endl;
+		generate_levels = false;
+	}
+	if (payload && octree_format == FORMAT_ESVO) {
+		cout << "ESVO child descriptors can't refer to voxel payloads, ignoring -esvo." << endl;
+		octree_format = FORMAT_STANDARD;
+	}
+	if (octree_format == FORMAT_ESVO && octree_layout == LAYOUT_BREADTH) {
+		cout << "ESVO child pointers only point backwards, ignoring -layout breadth." << endl;
+		octree_layout = LAYOUT_DEPTH;
+	}
+	if (payload && build_dag) {
+		cout << "Voxels with their own payload never make identical subtrees, ignoring -dag." << endl;
+		build_dag = false;
+	}
+#ifndef MAPPED_WRITER_AVAILABLE
+	if (mapped_output) {
+		cout << "Memory-mapped output is not available on this platform, ignoring -mmap." << endl;
+		mapped_output = false;
+	}
+#endif
+#ifndef MAPPED_TRIANGLES_AVAILABLE
+	if (mapped_input) {
+		cout << "Memory-mapped input is not available on this platform, ignoring -mmapin." << endl;
+		mapped_input = false;
+	}
+#endif
+	if (partition_in_core && partition_index_files) {
+		cout << "In-core partitions don't need any partition files, ignoring -indexfiles." << endl;
+		partition_index_files = false;
+	}
+	if (read_ahead && (partition_in_core || partition_index_files || adaptive_partitioning || trip_container || partition_cache || autotune_config)) {
+		cout << "-incore, -indexfiles, -adaptive, -container, -cache and -autotune need all source triangles in memory, ignoring -readahead." << endl;
+		read_ahead = false;
+	}
+	if (payload && (color == COLOR_FROM_MODEL || color == COLOR_NORMAL)) {
+		cout << "The .tri input only contains geometry, so voxels will get the fixed color." << endl;
+		color = COLOR_FIXED; color_s = "Fixed";
+	}
 	if (verbose) {
 		cout << "  filename: " << filename << endl;
 		cout << "  gridsize: " << gridsize << endl;
 		cout << "  memory limit: " << voxel_memory_limit << endl;
 		cout << "  sparseness optimization limit: " << sparseness_limit << " resulting in " << (sparseness_limit*voxel_memory_limit) << " memory limit." << endl;
+		cout << "  payload: " << payload << endl;
 		cout << "  color type: " << color_s << endl;
 		cout << "  generate levels: " << generate_levels << endl;
+		cout << "  lod filter: " << lodFilterName(lod_filter) << endl;
+		cout << "  esvo format: " << (octree_format == FORMAT_ESVO) << endl;
+		cout << "  build dag: " << build_dag << endl;
+		cout << "  layout: " << (octree_layout == LAYOUT_BREADTH ? "breadth" : "depth") << endl;
+		cout << "  mapped output: " << mapped_output << endl;
+		cout << "  mapped input: " << mapped_input << endl;
+		cout << "  partition container: " << trip_container << endl;
+		cout << "  adaptive partitioning: " << adaptive_partitioning << endl;
+		cout << "  autotune: " << autotune_config << endl;
+		cout << "  partition cache: " << partition_cache << endl;
+		cout << "  in-core partitions: " << partition_in_core << endl;
+		cout << "  index-only partition files: " << partition_index_files << endl;
+		cout << "  read-ahead: " << read_ahead << endl;
 		cout << "  verbosity: " << verbose << endl;
 	}
 }
@@ -243,35 +400,54 @@ void readTripHeader(string& filename, TripInfo& trip_info){
 		cout << "Not all required .trip or .tripdata files exist. Please regenerate using svo_builder." << endl; 
 		exit(0); // not all required files exist - exiting.
 	}
+	if (trip_info.index_bytes != 0 && trip_info.index_bytes != sizeof(unsigned int)) {
+		cout << "The .tripdata files hold " << trip_info.index_bytes << "-byte triangle indices, I can only read " << sizeof(unsigned int) << "-byte ones. Please regenerate using svo_builder." << endl;
+		exit(0);
+	}
 	if (verbose) { trip_info.print(); }
 }
 
-int main(int argc, char *argv[]) {
-	// Setup timers
-	setupTimers();
-	main_timer.start();
-
-#if defined(_WIN32) || defined(_WIN64)
-	_setmaxstdio(1024); // increase file descriptor limit in Windows
-#endif
-
-	// Parse program parameters
-	printInfo();
-	parseProgramParameters(argc, argv);
+// Amount of entries in the DAG table: it gets at most a quarter of the memory limit (two generations of blocks)
+size_t dagTableEntries() {
+	return build_dag ? max((size_t)1, (voxel_memory_limit * 1024 * 1024 / 8) / (sizeof(DagBlock) + 64)) : 0;
+}
 
-	// PARTITIONING
-	part_total_timer.start(); part_io_in_timer.start(); // TIMING
-	readTriHeader(filename, tri_info);
+// Rough cost of a voxel while its subtree is being built: its morton code, its node (twice), and its payload (twice)
+template <typename Payload>
+size_t subtreeVoxelBytes() {
+	return sizeof(mort_t) + 2 * sizeof(Node<Payload>) + (Payload::has_data ? 2 * sizeof(VoxelData) : 0);
+}
 
-    TriReaderIter *orig_reader = new TriReaderIter(tri_info.base_filename + string(".tridata"), tri_info.n_triangles, input_buffersize);
-	part_io_in_timer.stop();
+// Create the payload for a voxel. The voxelizer hands us morton codes and the normal of the triangle that filled the voxel
+// (as far as the voxel grid keeps it), so the color is derived from the voxel position.
+VoxelData voxelPayload(const mort_t morton, const vec3 &normal = vec3()) {
+	vec3 c = (color == COLOR_LINEAR) ? mortonToRGB(morton, gridsize) : fixed_color;
+	return VoxelData(morton, normal, c);
+}
 
-	size_t n_partitions = estimate_partitions(gridsize, voxel_memory_limit);
-	cout << "Partitioning data into " << n_partitions << " partitions ... "; cout.flush();
-    TripInfo trip_info = partition(tri_info, n_partitions, gridsize, orig_reader);
-	cout << "done." << endl;
-	part_total_timer.stop(); // TIMING
+// Build the subtrees of a batch of voxelized partitions in parallel, then merge them into the SVO in partition order.
+// A batch of one partition gets all cores for itself, larger batches build one partition per core.
+template <typename Payload>
+void buildPartitionBatch(OctreeBuilder<Payload> &builder, vector< PartitionSubtree<Payload> > &batch) {
+	if (batch.empty()) { return; }
+	cout << "Building SVO for " << batch.size() << " partition(s) ..." << endl;
+	svo_total_timer.start(); svo_algo_timer.start(); // TIMING
+#pragma omp parallel for num_threads((int)batch.size()) schedule(dynamic)
+	for (long long b = 0; b < (long long)batch.size(); b++) {
+		PartitionSubtree<Payload> &p = batch[b];
+		buildSubtree(p.codes, p.codes.size(), p.depth, generate_levels, lod_filter, p.nodes, p.data, p.root);
+		vector<mort_t>().swap(p.codes);
+	}
+	for (size_t b = 0; b < batch.size(); b++) {
+		builder.addSubtree(batch[b], batch[b].depth);
+	}
+	batch.clear();
+	svo_algo_timer.stop(); svo_total_timer.stop(); // TIMING
+}
 
+// Voxelize all partitions and build the SVO from them, with nodes using the given payload policy
+template <typename Payload>
+void voxelizeAndBuildSVO(TripInfo &trip_info, TriReaderIter *orig_reader, const PartitionIndex &index) {
 	vox_total_timer.start(); vox_io_in_timer.start(); // TIMING
 	// Parse TRIP header
 	string tripheader = trip_info.base_filename + string(".trip");
@@ -280,7 +456,7 @@ int main(int argc, char *argv[]) {
 
 	// General voxelization calculations (stuff we need throughout voxelization process)
 	float unitlength = (trip_info.mesh_bbox.max[0] - trip_info.mesh_bbox.min[0]) / (float)trip_info.gridsize;
-    mort_t morton_part = (trip_info.gridsize * trip_info.gridsize * trip_info.gridsize) / trip_info.n_partitions;
+    mort_t morton_part = trip_info.getMaxPartitionLength(); // partitions are equal, unless partitioned adaptively
 
     tbb::atomic<voxel_t>* voxels = new tbb::atomic<voxel_t>[(size_t)morton_part]; // Storage for voxel on/off
 
@@ -292,9 +468,19 @@ int main(int argc, char *argv[]) {
 
 	svo_total_timer.start();
 	// create Octreebuilder which will output our SVO
-	OctreeBuilder builder = OctreeBuilder(trip_info.base_filename, trip_info.gridsize, generate_levels);
+	OctreeBuilder<Payload> builder(trip_info.base_filename, trip_info.gridsize, generate_levels, lod_filter, octree_format, octree_layout, dagTableEntries(), mapped_output);
 	svo_total_timer.stop();
 
+	// Voxelized partitions are gathered in batches, whose subtrees get built in parallel
+	// A batch is limited to one partition per core, and to the voxel memory limit for the subtrees under construction
+	const size_t max_batch = (size_t)omp_get_max_threads();
+	const size_t batch_memory = subtree_memory ? subtree_memory : voxel_memory_limit * 1024 * 1024;
+	const size_t voxel_bytes = subtreeVoxelBytes<Payload>();
+	vector< PartitionSubtree<Payload> > batch;
+	batch.reserve(max_batch);
+	size_t batch_voxels = 0;
+	vector<unsigned int> part_indices; // triangle indices of the current partition, with index-only partition files
+
 	// Start voxelisation and SVO building per partition
     for (size_t i = 0; i < trip_info.n_partitions; i++) {
 		if (trip_info.part_tricounts[i] == 0) { continue; } // skip partition if it contains no triangles
@@ -303,67 +489,234 @@ int main(int argc, char *argv[]) {
 		vox_total_timer.start(); // TIMING
 		cout << "Voxelizing partition " << i << " ..." << endl;
 		// morton codes for this partition
-        mort_t start = i * morton_part;
-        mort_t end = (i + 1) * morton_part;
+        mort_t start = trip_info.getPartitionStart(i);
+        mort_t end = trip_info.getPartitionEnd(i);
 		// open file to read triangles
 		vox_io_in_timer.start(); // TIMING
-		std::string part_data_filename = trip_info.base_filename + string("_") + val_to_string(i) + string(".tripdata");
+		std::string part_data_filename = trip_info.getPartitionFilename(i); // its own file, or its extent in the container
         vox_io_in_timer.start();
-        TriReaderIter *reader = new TriReaderIter(part_data_filename, trip_info.part_tricounts[i], min(trip_info.part_tricounts[i], input_buffersize));
+        TriReaderIter *reader = orig_reader;
+		if (trip_info.index_bytes != 0) { // just the indices, read in one go
+			if (!readPartitionIndices(trip_info, i, part_indices)) {
+				cout << "Error: could not read " << trip_info.part_tricounts[i] << " triangle indices from " << part_data_filename << "." << endl;
+				exit(1);
+			}
+		}
+		else if (!trip_info.in_core) {
+			reader = openTriangles(part_data_filename, trip_info.part_tricounts[i], min(trip_info.part_tricounts[i], input_buffersize), trip_info.getPartitionOffset(i), mapped_input);
+		}
 
 
 
-        mort_t max_bytes_data = (mort_t) (((morton_part)*sizeof(char)) * sparseness_limit);
+        mort_t max_bytes_data = (mort_t) (((end - start)*sizeof(char)) * sparseness_limit);
 
         size_t data_max_items = max_bytes_data / sizeof(mort_t);
         data.reserve(data_max_items);
 
-		if (verbose) { cout << "  reading " << trip_info.part_tricounts[i] << " triangles from " << part_data_filename << endl; }
+		if (verbose) { cout << (reader->mapped() ? "  mapping " : "  reading ") << trip_info.part_tricounts[i] << " triangles from " << (trip_info.in_core ? string("memory") : part_data_filename) << endl; }
 		vox_io_in_timer.stop(); // TIMING
 		// voxelize partition
 		size_t nfilled_before = nfilled;
 		bool use_data = true;
-        voxelize_schwarz_method(reader, orig_reader, start, end, unitlength, voxels, data, sparseness_limit, use_data, nfilled);
+		if (trip_info.index_bytes != 0) { // index-only partition file: straight from the indices we read
+			voxelize_schwarz_method(&part_indices[0], part_indices.size(), orig_reader, start, end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, Payload::has_data);
+		}
+		else if (index.offsets.empty()) {
+			voxelize_schwarz_method(reader, orig_reader, start, end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, Payload::has_data);
+		}
+		else { // in-core partition: straight from its part of the index
+			voxelize_schwarz_method(&index.triangles[index.offsets[i]], trip_info.part_tricounts[i], orig_reader, start, end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, Payload::has_data);
+		}
 		if (verbose) { cout << "  found " << nfilled - nfilled_before << " new voxels." << endl; }
         cout << "  found " << nfilled - nfilled_before << " new voxels." << endl;
 
 		vox_total_timer.stop(); // TIMING
 
 		// build SVO
-		cout << "Building SVO for partition " << i << " ..." << endl;
-		svo_total_timer.start(); svo_algo_timer.start(); // TIMING
-
-        if (use_data){ // use array of morton codes to build the SVO
+        if (use_data){ // use array of morton codes: queue this partition's subtrees for the next batch
+			svo_total_timer.start(); svo_algo_timer.start(); // TIMING
             tbb::parallel_sort(data.begin(), data.end()); // sort morton codes
-            //sort(data.begin(), data.end());
-//            for (tbb::concurrent_vector<mort_t>::iterator it = data.begin(); it != data.end(); ++it){
-//				builder.addVoxel(*it);
-//			}
-            for (int i=0; i<data.size(); i++){
-                builder.addVoxel(data[i]);
-            }
-
+			// every aligned block of the partition's morton range is a complete subtree (an equal partition is just one)
+			size_t first = 0;
+			for (mort_t block_start = start; block_start < end;) {
+				const mort_t block_size = mortonBlockSize(block_start, end);
+				const size_t last = lower_bound(data.begin() + first, data.end(), block_start + block_size) - data.begin();
+				block_start += block_size;
+				if (last == first) { continue; } // empty block
+				batch.push_back(PartitionSubtree<Payload>());
+				PartitionSubtree<Payload> &p = batch.back();
+				p.morton_start = block_start - block_size;
+				p.depth = findPowerOf8(block_size);
+				p.codes.assign(data.begin() + first, data.begin() + last);
+				if (Payload::has_data) { // every voxel gets its own payload
+					p.data.resize(p.codes.size());
+#pragma omp parallel for
+					for (long long j = 0; j < (long long)p.codes.size(); j++) {
+						p.data[j] = voxelPayload(p.codes[j], decodeVoxelNormal(voxels[p.codes[j] - start]));
+					}
+				}
+				batch_voxels += p.codes.size();
+				first = last;
+				if (batch.size() == max_batch || batch_voxels * voxel_bytes >= batch_memory) {
+					svo_algo_timer.stop(); svo_total_timer.stop(); // TIMING
+					buildPartitionBatch(builder, batch);
+					svo_total_timer.start(); svo_algo_timer.start(); // TIMING
+					batch_voxels = 0;
+				}
+			}
+			svo_algo_timer.stop(); svo_total_timer.stop(); // TIMING
 		}
 		else { // morton array overflowed : using slower way to build SVO
+			buildPartitionBatch(builder, batch); // earlier partitions go first
+			batch_voxels = 0;
+			cout << "Building SVO for partition " << i << " ..." << endl;
+			svo_total_timer.start(); svo_algo_timer.start(); // TIMING
             mort_t morton_number;
-			for (size_t j = 0; j < morton_part; j++) {
+			for (size_t j = 0; j < end - start; j++) {
 				if (!voxels[j] == EMPTY_VOXEL) {
 					morton_number = start + j;
-					builder.addVoxel(morton_number);
+					if (Payload::has_data) { builder.addVoxel(voxelPayload(morton_number, decodeVoxelNormal(voxels[j]))); }
+					else { builder.addVoxel(morton_number); }
 				}
 			}
+			svo_algo_timer.stop(); svo_total_timer.stop();  // TIMING
 		}
-        delete reader;
-		svo_algo_timer.stop(); svo_total_timer.stop();  // TIMING
+        if (reader != orig_reader) { delete reader; }
 	}
+	buildPartitionBatch(builder, batch);
 	svo_total_timer.start(); svo_algo_timer.start(); // TIMING
 	builder.finalizeTree(); // finalize SVO so it gets written to disk
 	cout << "done" << endl;
     cout << "Total amount of voxels: " << nfilled << endl;
 	svo_total_timer.stop(); svo_algo_timer.stop(); // TIMING
+	delete[] voxels;
+
+}
+
+int main(int argc, char *argv[]) {
+	// Setup timers
+	setupTimers();
+	main_timer.start();
+
+#if defined(_WIN32) || defined(_WIN64)
+	_setmaxstdio(1024); // increase file descriptor limit in Windows
+#endif
+
+	// Parse program parameters
+	printInfo();
+	parseProgramParameters(argc, argv);
+
+	// PARTITIONING
+	part_total_timer.start(); part_io_in_timer.start(); // TIMING
+	readTriHeader(filename, tri_info);
+
+	if (read_ahead && tri_info.indexed) {
+		cout << "Indexed meshes are read in one go, ignoring -readahead." << endl;
+		read_ahead = false;
+	}
+
+	// A streamed source is only read while partitioning (the partitions have their own triangles), unless there's just one partition
+	size_t n_partitions = 0;
+	if (read_ahead) {
+		n_partitions = estimate_partitions(gridsize, voxel_memory_limit);
+	}
+	const bool stream_source = read_ahead && n_partitions > 1;
+	TriReaderIter *orig_reader;
+	if (stream_source) {
+		orig_reader = new TriReaderIter();
+		const size_t triangle_size = tri_info.quantization ? quantizedTriangleSize(tri_info.quantization) : TRIANGLE_SIZE * sizeof(float);
+		if (file_size(tri_info.base_filename + string(".tridata")) < tri_info.n_triangles * triangle_size) {
+			cout << "Could not read all triangles of " << filename << ". Please regenerate using tri_convert." << endl;
+			exit(0);
+		}
+	}
+	else {
+		orig_reader = readSourceTriangles(tri_info, input_buffersize, mapped_input);
+		if (orig_reader->span().size() != tri_info.n_triangles) {
+			cout << "Could not read all triangles of " << filename << ". Please regenerate using tri_convert." << endl;
+			exit(0);
+		}
+	}
+	if (verbose && orig_reader->mapped()) { cout << "  mapped " << tri_info.n_triangles << " source triangles" << endl; }
+	part_io_in_timer.stop();
 
-	// Removing .trip files which are left by partitioner
-	removeTripFiles(trip_info);
+	// Memory model of the whole run: let it pick the configuration, or just report on the given one (it needs the source triangles)
+	MeshStats mesh;
+	PipelineSetup setup;
+	if (autotune_config || (verbose && !stream_source)) {
+		mesh = measureMesh(orig_reader, tri_info, gridsize);
+		setup.reader_buffer = input_buffersize;
+		setup.voxel_bytes = payload ? subtreeVoxelBytes<VoxelPayload>() : subtreeVoxelBytes<BinaryPayload>();
+		setup.dag_bytes = dagTableEntries() * (sizeof(DagBlock) + 64);
+		setup.adaptive = adaptive_partitioning;
+		setup.container = trip_container;
+		setup.in_core = partition_in_core;
+		setup.index_files = partition_index_files;
+	}
+	if (autotune_config) {
+		cout << "Autotuning for a memory limit of " << voxel_memory_limit << " Mb ..." << endl;
+		PipelineConfig config = autotune(mesh, setup, voxel_memory_limit * 1024 * 1024, omp_get_max_threads());
+		n_partitions = config.n_partitions;
+		sparseness_limit = config.sparseness_limit;
+		subtree_memory = max((size_t)1, config.batch_memory);
+		omp_set_num_threads(config.n_threads);
+		cout << "  going to use " << n_partitions << " partitions, " << config.n_threads << " threads, a side buffer of "
+			<< (size_t)(sparseness_limit * 100) << "% and " << subtree_memory / 1024 / 1024 << " Mb for subtrees." << endl;
+	}
+	else if (n_partitions == 0) {
+		n_partitions = estimate_partitions(gridsize, voxel_memory_limit);
+	}
+	if (verbose && !stream_source) {
+		PipelineConfig config;
+		config.n_partitions = n_partitions;
+		config.n_threads = omp_get_max_threads();
+		config.sparseness_limit = sparseness_limit;
+		config.batch_memory = subtree_memory ? subtree_memory : voxel_memory_limit * 1024 * 1024;
+		cout << "Estimated memory use:" << endl;
+		estimateMemory(mesh, setup, config).print();
+	}
+
+	// Reuse the partitions of an earlier build if they're still valid (just one partition doesn't need any files)
+	const bool use_cache = partition_cache && n_partitions > 1 && !partition_in_core;
+	unsigned long long source_hash = 0;
+	TripInfo trip_info;
+	PartitionIndex partition_index; // stays empty unless the partitions are kept in memory
+	bool cached = false;
+	if (use_cache) {
+		part_algo_timer.start(); // TIMING
+		source_hash = hashTriangles(orig_reader);
+		part_algo_timer.stop(); part_io_in_timer.start(); // TIMING
+		cached = findCachedPartitions(tri_info, n_partitions, gridsize, trip_container, adaptive_partitioning, partition_index_files, source_hash, trip_info);
+		part_io_in_timer.stop(); // TIMING
+	}
+	if (cached) {
+		cout << "Reusing cached partitioning " << trip_info.base_filename << ".trip with " << trip_info.n_partitions << " partitions." << endl;
+	}
+	else {
+		cout << "Partitioning data into " << n_partitions << " partitions ... "; cout.flush();
+		trip_info = partition(tri_info, n_partitions, gridsize, orig_reader, trip_container, adaptive_partitioning, partition_index_files,
+			partition_in_core ? &partition_index : NULL, stream_source);
+		cout << "done." << endl;
+		if (use_cache) {
+			trip_info.source_hash = source_hash;
+			part_io_out_timer.start(); // TIMING
+			cachePartitions(tri_info, n_partitions, gridsize, trip_container, adaptive_partitioning, partition_index_files, trip_info);
+			part_io_out_timer.stop(); // TIMING
+		}
+	}
+	part_total_timer.stop(); // TIMING
+
+	if (payload) {
+		voxelizeAndBuildSVO<VoxelPayload>(trip_info, orig_reader, partition_index);
+	}
+	else {
+		voxelizeAndBuildSVO<BinaryPayload>(trip_info, orig_reader, partition_index);
+	}
+
+	// Removing .trip files which are left by partitioner, unless we keep them for the next build
+	if (!use_cache) {
+		removeTripFiles(trip_info);
+	}
 
 	main_timer.stop();
 	printTimerInfo();
@@ -0,0 +1,239 @@
+#include "memory_model.h"
+#include <math.h>
+#include "partitioner.h"
+#include "AsyncWriter.h"
+
+using namespace std;
+using namespace trimesh;
+
+// Measure the mesh on at most this many triangles
+#define MODEL_SAMPLES 262144
+// Cells per axis of the surface histogram (at most)
+#define MODEL_CELLS_PER_AXIS 64
+
+// Runtime model: rough cost (in seconds, on one core) of the things the pipeline does most.
+// Only their ratios matter, since they're only used to compare configurations.
+#define COST_BIN 2e-8 // binning a triangle into a partition
+#define COST_IO_BYTE 1e-9 // writing or reading back a byte of partitioned triangles
+#define COST_TRIANGLE 5e-8 // setting up a triangle for voxelization
+#define COST_VOXEL_TEST 5e-9 // testing a voxel of the bounding box of a triangle
+#define COST_CLEAR 2e-10 // clearing a voxel of the voxel grid of a partition
+#define COST_PARTITION 2e-3 // fixed cost of a partition: opening and reading its file, a batch entry
+#define COST_BUILD 5e-8 // building the SVO for a voxel from the sorted morton codes
+#define COST_SCAN 1e-9 // scanning a voxel of the voxel grid, when the side buffer overflowed
+#define COST_ADD 2e-7 // adding a voxel to the SVO one by one, when the side buffer overflowed
+
+// Partitions (per axis) of n equal partitions
+static size_t partsPerAxis(const size_t n){
+	size_t parts = 1;
+	while (parts * parts * parts < n){ parts *= 2; }
+	return parts;
+}
+
+// Average amount of partitions a triangle ends up in, with n equal partitions
+static double duplication(const MeshStats &mesh, const size_t n){
+	const double side = (double)mesh.gridsize / partsPerAxis(n); // in voxels
+	const double d = 1.0 + mesh.mean_extent / side;
+	return min(d * d * d, (double)n);
+}
+
+// Triangles in the fullest of n equal partitions: its share of the triangles, skewed like its share of the voxels
+static size_t fullestPartition(const MeshStats &mesh, const size_t n, const double dup, const double max_voxels){
+	const double skew = (mesh.total_voxels > 0) ? max(1.0, max_voxels * n / mesh.total_voxels) : 1.0;
+	return min(mesh.n_triangles, (size_t)(mesh.n_triangles * dup * skew / n));
+}
+
+// Estimated amount of filled voxels in each of n equal partitions. Partitions smaller than a histogram cell share its voxels equally.
+static void partitionVoxels(const MeshStats &mesh, const size_t n, vector<double> &voxels){
+	voxels.assign(n, 0.0);
+	if (n >= mesh.n_cells){
+		const size_t per_cell = n / mesh.n_cells;
+		for (size_t p = 0; p < n; p++){ voxels[p] = mesh.cell_voxels[p / per_cell] / per_cell; }
+	}
+	else {
+		const size_t cells = mesh.n_cells / n;
+		for (size_t c = 0; c < mesh.n_cells; c++){ voxels[c / cells] += mesh.cell_voxels[c]; }
+	}
+}
+
+// Measure the mesh: the mean size of its triangles, and where its surface voxels will be. A conservative surface
+// voxelization fills about as many voxels as the projected area of a triangle on the three axis planes.
+MeshStats measureMesh(const TriReaderIter* reader, const TriInfo &tri_info, const size_t gridsize){
+	MeshStats mesh;
+	mesh.gridsize = gridsize;
+	const TriangleSpan tris = reader->span();
+	mesh.n_triangles = tris.size();
+	const size_t per_axis = min((size_t)MODEL_CELLS_PER_AXIS, gridsize);
+	mesh.n_cells = per_axis * per_axis * per_axis;
+	mesh.cell_voxels.assign(mesh.n_cells, 0.0);
+	if (mesh.n_triangles == 0){ return mesh; }
+
+	const float unitlength = (tri_info.mesh_bbox.max[0] - tri_info.mesh_bbox.min[0]) / (float)gridsize;
+	const double cell_side = (double)(gridsize / per_axis) * unitlength;
+	const size_t stride = max((size_t)1, mesh.n_triangles / MODEL_SAMPLES);
+	double extent = 0;
+	size_t n_sampled = 0;
+	for (size_t t = 0; t < mesh.n_triangles; t += stride){
+		const Triangle &tri = tris[t];
+		AABox<vec3> bbox = computeBoundingBox(tri.v0, tri.v1, tri.v2);
+		unsigned int first[3], last[3];
+		for (int a = 0; a < 3; a++){
+			extent += (bbox.max[a] - bbox.min[a]) / unitlength;
+			first[a] = (unsigned int)clampval<double>(floor(bbox.min[a] / cell_side), 0.0, (double)(per_axis - 1));
+			last[a] = (unsigned int)clampval<double>(floor(bbox.max[a] / cell_side), 0.0, (double)(per_axis - 1));
+		}
+		const vec3 normal = (tri.v1 - tri.v0) CROSS (tri.v2 - tri.v0);
+		const double voxels = stride * (1.0 + 0.5 * (fabs(normal[0]) + fabs(normal[1]) + fabs(normal[2])) / ((double)unitlength * unitlength));
+		const double share = voxels / ((double)(last[0] - first[0] + 1) * (last[1] - first[1] + 1) * (last[2] - first[2] + 1));
+		for (unsigned int x = first[0]; x <= last[0]; x++){
+			for (unsigned int y = first[1]; y <= last[1]; y++){
+				for (unsigned int z = first[2]; z <= last[2]; z++){
+					mesh.cell_voxels[(size_t)mortonEncode_LUT(z, y, x)] += share;
+				}
+			}
+		}
+		mesh.total_voxels += voxels;
+		n_sampled++;
+	}
+	mesh.mean_extent = extent / (3.0 * n_sampled);
+	return mesh;
+}
+
+// Estimate the memory use of a configuration. With adaptive partitioning, partitions are never larger than the equal ones,
+// so those are used as an upper bound.
+MemoryEstimate estimateMemory(const MeshStats &mesh, const PipelineSetup &setup, const PipelineConfig &config){
+	MemoryEstimate m;
+	const size_t n = config.n_partitions;
+	const size_t length = (mesh.gridsize * mesh.gridsize * mesh.gridsize) / n;
+	vector<double> part_voxels;
+	partitionVoxels(mesh, n, part_voxels);
+	const double max_voxels = *max_element(part_voxels.begin(), part_voxels.end());
+
+	// the source triangles, and the buffer they were read through
+	m.source = (mesh.n_triangles + setup.reader_buffer) * sizeof(Triangle);
+
+	// with just one partition, everything is voxelized straight from the source triangles
+	if (n > 1 && (setup.in_core || setup.index_files)){ // the index is built with counts per thread, and kept while voxelizing (or written out)
+		const double dup = duplication(mesh, n);
+		const size_t index = (size_t)(mesh.n_triangles * dup) * sizeof(unsigned int) + (n + 1) * sizeof(size_t);
+		m.partitioning = index + config.n_threads * n * sizeof(size_t);
+		if (setup.adaptive){ m.partitioning += (config.n_threads + 2) * adaptiveCells(n, mesh.gridsize) * sizeof(double); }
+		m.reader = setup.in_core ? index : fullestPartition(mesh, n, dup, max_voxels) * sizeof(unsigned int);
+	}
+	else if (n > 1){
+		const double dup = duplication(mesh, n);
+		m.partitioning = (size_t)(2.0 * partition_chunksize * dup) * sizeof(Triangle) // thread bins: a chunk between them (twice, for vector growth)
+			+ config.n_threads * n * sizeof(size_t) // and their counts per partition
+			+ n * (partitionBlockSize(n, output_buffersize) * sizeof(Triangle) + BUFSIZ + sizeof(Buffer)) // Buffers and their FILEs
+			+ PARTITION_WRITER_QUEUED; // batches queued for the writer threads
+		if (setup.container){ m.partitioning += config.n_threads * n * sizeof(size_t); }
+		if (setup.adaptive){ m.partitioning += (config.n_threads + 2) * adaptiveCells(n, mesh.gridsize) * sizeof(double); }
+
+		const size_t tris = fullestPartition(mesh, n, dup, max_voxels);
+		m.reader = (tris + min(tris, setup.reader_buffer)) * sizeof(Triangle); // TriReaderIter keeps them all, next to its read buffer
+	}
+
+	m.voxels = length * sizeof(voxel_t);
+	m.side_buffer = (size_t)(length * config.sparseness_limit);
+
+	// a batch holds a subtree per thread at most, but it only gets built once it's over the batch memory
+	const size_t subtree = (size_t)(max_voxels * setup.voxel_bytes);
+	m.builder = min(config.batch_memory + subtree, config.n_threads * subtree) + setup.dag_bytes
+		+ 2 * ASYNC_WRITER_NBUFFERS * ASYNC_WRITER_BUFFERSIZE; // node and data writers
+	return m;
+}
+
+// Estimate the runtime of a configuration, in seconds
+double estimateRuntime(const MeshStats &mesh, const PipelineSetup &setup, const PipelineConfig &config){
+	const size_t n = config.n_partitions;
+	const double threads = config.n_threads;
+	const double length = (double)((mesh.gridsize * mesh.gridsize * mesh.gridsize) / n);
+	const double side = (double)mesh.gridsize / partsPerAxis(n);
+	const double tris = mesh.n_triangles * duplication(mesh, n);
+	double time = 0;
+
+	// partitioning: binning on all threads, writing the partitions and reading them back (in-core: two binning passes, no files)
+	if (n > 1 && setup.in_core){
+		time += 2.0 * tris * COST_BIN / threads;
+	}
+	else if (n > 1 && setup.index_files){
+		time += 2.0 * tris * COST_BIN / threads + 2.0 * tris * sizeof(unsigned int) * COST_IO_BYTE;
+	}
+	else if (n > 1){
+		time += tris * COST_BIN / threads + 2.0 * tris * TRIANGLE_SIZE * sizeof(float) * COST_IO_BYTE;
+	}
+
+	// voxelization: triangles are spread over the threads, the voxel grid of every partition gets cleared
+	const double box = min(mesh.mean_extent, side) + 1.0;
+	time += tris * (COST_TRIANGLE + box * box * box * COST_VOXEL_TEST) / threads + n * (length * COST_CLEAR + COST_PARTITION);
+
+	// svo building: partitions of which the morton codes fit in the side buffer get built in parallel batches,
+	// the others one voxel at a time
+	vector<double> part_voxels;
+	partitionVoxels(mesh, n, part_voxels);
+	const double side_codes = length * config.sparseness_limit / sizeof(mort_t);
+	double batched = 0;
+	for (size_t p = 0; p < n; p++){
+		if (part_voxels[p] <= side_codes){ batched += part_voxels[p]; }
+		else { time += length * COST_SCAN + part_voxels[p] * COST_ADD; }
+	}
+	const double subtree_bytes = max(1.0, mesh.total_voxels / n * setup.voxel_bytes);
+	const double build_threads = max(1.0, min(threads, floor(config.batch_memory / subtree_bytes) + 1.0));
+	time += batched * COST_BUILD / build_threads;
+	return time;
+}
+
+// Pick the fastest configuration within the memory budget (in bytes). For every partition count and thread count,
+// the side buffer gets what it needs for the fullest partition first (overflowing is slow), then the batches get the rest.
+PipelineConfig autotune(const MeshStats &mesh, const PipelineSetup &setup, const size_t memory_budget, const int max_threads){
+	const size_t max_partitions = min((size_t)262144, max((size_t)1, (mesh.gridsize * mesh.gridsize * mesh.gridsize) / 512)); // at least 8^3 voxels each
+	PipelineConfig best, smallest;
+	double best_time = 0;
+	bool found = false;
+	size_t smallest_peak = 0;
+
+	for (size_t n = 1; n <= max_partitions; n *= 8){
+		const size_t length = (mesh.gridsize * mesh.gridsize * mesh.gridsize) / n;
+		vector<double> part_voxels;
+		partitionVoxels(mesh, n, part_voxels);
+		const double max_voxels = *max_element(part_voxels.begin(), part_voxels.end());
+
+		for (int threads = 1; threads <= max_threads; threads++){
+			PipelineConfig config;
+			config.n_partitions = n;
+			config.n_threads = threads;
+			config.sparseness_limit = 0;
+			config.batch_memory = 0;
+			const MemoryEstimate base = estimateMemory(mesh, setup, config);
+			if (smallest_peak == 0 || base.peak() < smallest_peak){
+				smallest = config;
+				smallest_peak = base.peak();
+			}
+			if (base.peak() > memory_budget){ continue; }
+
+			const size_t room = memory_budget - (base.source + base.reader + base.voxels + base.builder);
+			const size_t needed = (size_t)(max_voxels * 1.25) * sizeof(mort_t) + sizeof(mort_t);
+			const size_t side_buffer = min(needed, room);
+			config.sparseness_limit = (float)((double)side_buffer / length);
+			config.batch_memory = room - side_buffer;
+
+			const double time = estimateRuntime(mesh, setup, config);
+			if (verbose){
+				cout << "  " << n << " partitions, " << threads << " threads: side buffer " << side_buffer / 1024 / 1024 << " Mb, batches "
+					<< config.batch_memory / 1024 / 1024 << " Mb, estimated " << time << " s" << endl;
+			}
+			if (!found || time < best_time){
+				best = config;
+				best_time = time;
+				found = true;
+			}
+		}
+	}
+
+	if (!found){
+		cout << "  Warning: even the smallest configuration (" << smallest.n_partitions << " partitions, " << smallest.n_threads
+			<< " thread) needs about " << smallest_peak / 1024 / 1024 << " Mb, over the memory limit of " << memory_budget / 1024 / 1024 << " Mb" << endl;
+		return smallest;
+	}
+	return best;
+}
@@ -0,0 +1,82 @@
+#ifndef MEMORY_MODEL_H_
+#define MEMORY_MODEL_H_
+
+#include <vector>
+#include <tri_tools.h>
+#include <TriReaderIter.h>
+#include "morton.h"
+
+using namespace std;
+
+// Memory model of the whole pipeline (partitioning, voxelization and SVO building), and an autotuner on top of it.
+// The model accounts for every large allocation, the autotuner picks the partition count, the size of the side buffer
+// with morton codes and the thread count which it estimates to be the fastest, within the memory budget.
+
+// What we know about the mesh, measured from (a sample of) the source triangles
+struct MeshStats {
+	size_t gridsize;
+	size_t n_triangles;
+	double mean_extent; // mean size of the bounding box of a triangle along an axis, in voxels
+	size_t n_cells; // cells of the surface histogram: a grid of 8^k cells, in morton order
+	vector<double> cell_voxels; // estimated amount of filled voxels in every cell
+	double total_voxels;
+
+	MeshStats() : gridsize(0), n_triangles(0), mean_extent(0), n_cells(1), cell_voxels(1, 0.0), total_voxels(0) {}
+};
+
+// The parts of the build the autotuner doesn't choose, as far as they matter for memory use
+struct PipelineSetup {
+	size_t reader_buffer; // triangles buffered by a TriReader
+	size_t voxel_bytes; // memory for every voxel of a subtree under construction
+	size_t dag_bytes; // DAG table (0 if we're not building a DAG)
+	bool adaptive; // adaptive partitioning: fine histogram over the partitions
+	bool container; // partition container: triangle counts per thread and partition
+	bool in_core; // in-core partitions: an index of the source triangles instead of partition files
+	bool index_files; // index-only partition files: that index gets written out, and read back per partition
+
+	PipelineSetup() : reader_buffer(8192), voxel_bytes(0), dag_bytes(0), adaptive(false), container(false), in_core(false), index_files(false) {}
+};
+
+// The settings the autotuner chooses
+struct PipelineConfig {
+	size_t n_partitions;
+	int n_threads;
+	float sparseness_limit; // side buffer for morton codes, as a fraction of the voxels of a partition (in bytes)
+	size_t batch_memory; // bytes for the subtrees of a batch under construction
+
+	PipelineConfig() : n_partitions(1), n_threads(1), sparseness_limit(0.10f), batch_memory(0) {}
+};
+
+// Estimated memory use of a configuration, in bytes
+struct MemoryEstimate {
+	size_t source; // all source triangles, which stay in memory for the whole run
+	size_t partitioning; // chunk of triangles, per-thread bins, partition Buffers, counts and histograms
+	size_t reader; // triangles of the partition being voxelized
+	size_t voxels; // voxel grid of a partition
+	size_t side_buffer; // morton codes of the filled voxels of a partition
+	size_t builder; // subtrees under construction, DAG table and output buffers
+
+	MemoryEstimate() : source(0), partitioning(0), reader(0), voxels(0), side_buffer(0), builder(0) {}
+
+	// partitioning is done (and its memory freed) before voxelization starts
+	size_t peak() const{
+		return source + max(partitioning, reader + voxels + side_buffer + builder);
+	}
+
+	void print() const{
+		cout << "  source triangles: " << source / 1024 / 1024 << " Mb" << endl;
+		cout << "  partitioning: " << partitioning / 1024 / 1024 << " Mb" << endl;
+		cout << "  partition reader: " << reader / 1024 / 1024 << " Mb" << endl;
+		cout << "  voxel grid: " << voxels / 1024 / 1024 << " Mb" << endl;
+		cout << "  side buffer: " << side_buffer / 1024 / 1024 << " Mb" << endl;
+		cout << "  svo builder: " << builder / 1024 / 1024 << " Mb" << endl;
+		cout << "  peak: " << peak() / 1024 / 1024 << " Mb" << endl;
+	}
+};
+
+MeshStats measureMesh(const TriReaderIter* reader, const TriInfo &tri_info, const size_t gridsize);
+MemoryEstimate estimateMemory(const MeshStats &mesh, const PipelineSetup &setup, const PipelineConfig &config);
+double estimateRuntime(const MeshStats &mesh, const PipelineSetup &setup, const PipelineConfig &config);
+PipelineConfig autotune(const MeshStats &mesh, const PipelineSetup &setup, const size_t memory_budget, const int max_threads);
+
+#endif // MEMORY_MODEL_H_
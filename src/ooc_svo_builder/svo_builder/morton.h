@@ -183,4 +183,13 @@ inline void mortonDecode(mort_t morton, unsigned int& x, unsigned int& y, unsign
 	}
 }
 
+// size of the largest aligned block of morton codes (a power of 8, so a complete subtree) starting at pos, ending at or before end
+inline mort_t mortonBlockSize(const mort_t pos, const mort_t end){
+	mort_t size = 1;
+	while (size < (mort_t(1ull) << 60) && (pos & ((size << 3) - 1)) == 0 && (size << 3) <= end - pos) {
+		size = size << 3;
+	}
+	return size;
+}
+
 #endif // MORTON_H_
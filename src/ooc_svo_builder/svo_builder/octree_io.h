@@ -2,14 +2,32 @@
 #define OCTREE_IO_H_
 
 #include <stdio.h>
+#include <stdint.h>
 #include <fstream>
+#include <vector>
 #include <file_tools.h>
 #include "Node.h"
+#include "FileWriter.h"
 
 using namespace std;
 
 // File containing all the octree IO methods
 
+// Size of a node in a standard .octreenodes file: data address, children base address, 8 child offsets
+#define NODE_FILE_SIZE (3 * sizeof(size_t))
+
+// Layout of the .octreenodes file
+enum OctreeFormat {
+	FORMAT_STANDARD, // 3 size_t's per node: data address, children base address, 8 child offsets
+	FORMAT_ESVO // 32-bit child descriptors for all non-leaf nodes, with far pointers (geometry only)
+};
+
+// Order of the nodes in the .octreenodes file
+enum OctreeLayout {
+	LAYOUT_DEPTH, // depth-first post-order: a children block comes after everything below it, the root is last
+	LAYOUT_BREADTH // level by level: the root first, then all nodes of level 1, level 2, ... down to the leafs
+};
+
 // Internal format to represent an octree
 struct OctreeInfo {
 	int version;
@@ -17,9 +35,13 @@ struct OctreeInfo {
 	size_t gridlength;
 	size_t n_nodes;
 	size_t n_data;
+	OctreeFormat format;
+	bool dag; // identical subtrees are shared: nodes can have more than one parent
+	OctreeLayout layout;
+	vector<size_t> level_offsets; // breadth-first layout: position of the first node of every level
 
-	OctreeInfo() : version(1), base_filename(string("")), gridlength(1024), n_nodes(0), n_data(0) {}
-	OctreeInfo(int version, string base_filename, size_t gridlength, size_t n_nodes, size_t n_data) : version(version), base_filename(base_filename), gridlength(gridlength), n_nodes(n_nodes), n_data(n_data) {} 
+	OctreeInfo() : version(1), base_filename(string("")), gridlength(1024), n_nodes(0), n_data(0), format(FORMAT_STANDARD), dag(false), layout(LAYOUT_DEPTH) {}
+	OctreeInfo(int version, string base_filename, size_t gridlength, size_t n_nodes, size_t n_data, OctreeFormat format = FORMAT_STANDARD, bool dag = false) : version(version), base_filename(base_filename), gridlength(gridlength), n_nodes(n_nodes), n_data(n_data), format(format), dag(dag), layout(LAYOUT_DEPTH) {} 
 
 	void print() const{
 		cout << "  version: " << version << endl;
@@ -27,6 +49,12 @@ struct OctreeInfo {
 		cout << "  grid length: " << gridlength << endl;
 		cout << "  n_nodes: " << n_nodes << endl;
 		cout << "  n_data: " << n_data << endl;
+		cout << "  format: " << (format == FORMAT_ESVO ? "esvo" : "standard") << endl;
+		cout << "  dag: " << dag << endl;
+		cout << "  layout: " << (layout == LAYOUT_BREADTH ? "breadth" : "depth") << endl;
+		for (size_t l = 0; l < level_offsets.size(); l++){
+			cout << "  level " << l << " starts at node " << level_offsets[l] << endl;
+		}
 	}
 
 	// check if all files required by Tri exist
@@ -40,8 +68,14 @@ struct OctreeInfo {
 
 size_t writeVoxelData(FILE* f, const VoxelData &v, size_t &b_data_pos);
 void readVoxelData(FILE* f, VoxelData &v);
-size_t writeNode(FILE* node_out, const Node &n, size_t &b_node_pos);
-inline void readNode(FILE* f, Node &n);
+template <typename Payload> size_t writeNode(FILE* node_out, const Node<Payload> &n, size_t &b_node_pos);
+size_t writeVoxelData(FileWriter &w, const VoxelData &v, size_t &b_data_pos);
+template <typename Payload> size_t writeNode(FileWriter &w, const Node<Payload> &n, size_t &b_node_pos);
+template <typename Payload> void writeNodes(FileWriter &w, const Node<Payload>* nodes, const size_t n, size_t &b_node_pos);
+void writeVoxelDataArray(FileWriter &w, const VoxelData* v, const size_t n, size_t &b_data_pos);
+template <typename Payload> void readNode(FILE* f, Node<Payload> &n);
+uint32_t makeChildDescriptor(const size_t pointer, const bool far, const unsigned char valid_mask, const unsigned char leaf_mask);
+size_t writeChildDescriptor(FileWriter &w, const uint32_t descriptor, size_t &b_node_pos);
 
 void writeOctreeHeader(const std::string &filename, const OctreeInfo &i);
 int parseOctreeHeader(const std::string &filename, OctreeInfo &i);
@@ -53,6 +87,27 @@ inline size_t writeVoxelData(FILE* f, const VoxelData &v, size_t &b_data_pos){
 	return b_data_pos-1;
 }
 
+// Write a data point to a buffered writer
+inline size_t writeVoxelData(FileWriter &w, const VoxelData &v, size_t &b_data_pos){
+	w.write(&v.morton, VOXELDATA_SIZE);
+	b_data_pos++;
+	return b_data_pos-1;
+}
+
+// Write an array of data points to a buffered writer, in one go if the in-memory layout matches the file layout
+inline void writeVoxelDataArray(FileWriter &w, const VoxelData* v, const size_t n, size_t &b_data_pos){
+	if (n == 0){ return; }
+	if (sizeof(VoxelData) == VOXELDATA_SIZE){
+		w.write(&v[0].morton, n * sizeof(VoxelData));
+		b_data_pos += n;
+	}
+	else {
+		for (size_t i = 0; i < n; i++){
+			writeVoxelData(w, v[i], b_data_pos);
+		}
+	}
+}
+
 // Read a data point from a file
 inline void readDataPoint(FILE* f, VoxelData &v){
 	v.morton = 0;
@@ -60,17 +115,63 @@ inline void readDataPoint(FILE* f, VoxelData &v){
 }
 
 // Write an octree node to file
-inline size_t writeNode(FILE* node_out, const Node &n, size_t &b_node_pos){
+template <typename Payload>
+inline size_t writeNode(FILE* node_out, const Node<Payload> &n, size_t &b_node_pos){
 	fwrite(& n.data, sizeof(size_t), 3, node_out);
 	b_node_pos++;
 	return b_node_pos-1;
 }
 
+// Write an octree node to a buffered writer
+template <typename Payload>
+inline size_t writeNode(FileWriter &w, const Node<Payload> &n, size_t &b_node_pos){
+	w.write(& n.data, 3 * sizeof(size_t));
+	b_node_pos++;
+	return b_node_pos-1;
+}
+
+// Write an array of octree nodes to a buffered writer, in one go if the in-memory layout matches the file layout
+template <typename Payload>
+inline void writeNodes(FileWriter &w, const Node<Payload>* nodes, const size_t n, size_t &b_node_pos){
+	if (n == 0){ return; }
+	if (sizeof(Node<Payload>) == 3 * sizeof(size_t)){
+		w.write(& nodes[0].data, n * sizeof(Node<Payload>));
+		b_node_pos += n;
+	}
+	else {
+		for (size_t i = 0; i < n; i++){
+			writeNode(w, nodes[i], b_node_pos);
+		}
+	}
+}
+
 // Read a Node from a file
-inline void readNode(FILE* f, Node &n){
+template <typename Payload>
+inline void readNode(FILE* f, Node<Payload> &n){
 	fread(& n.data, sizeof(size_t), 3, f);
 }
 
+// ESVO child descriptors (Laine and Karras, Efficient Sparse Voxel Octrees), one 32-bit word each:
+// bits 17-31: child pointer, bit 16: far flag, bits 8-15: valid mask, bits 0-7: leaf mask.
+// Only non-leaf children get a descriptor, stored next to each other in child slot order. Since children are written
+// before their parent, the child pointer is the distance (in words) back from the descriptor to the first child descriptor.
+// If it doesn't fit in 15 bits, the far flag is set and the pointer is the distance back to a 32-bit far pointer word,
+// which holds the distance from itself back to the first child descriptor.
+#define ESVO_POINTER_BITS 15
+#define ESVO_MAX_POINTER ((1 << ESVO_POINTER_BITS) - 1)
+
+// Pack an ESVO child descriptor
+inline uint32_t makeChildDescriptor(const size_t pointer, const bool far, const unsigned char valid_mask, const unsigned char leaf_mask){
+	return ((uint32_t)pointer << 17) | ((far ? 1u : 0u) << 16) | ((uint32_t)valid_mask << 8) | (uint32_t)leaf_mask;
+}
+
+// Write an ESVO child descriptor or far pointer word to a buffered writer
+inline size_t writeChildDescriptor(FileWriter &w, const uint32_t descriptor, size_t &b_node_pos){
+	w.write(&descriptor, sizeof(uint32_t));
+	b_node_pos++;
+	return b_node_pos-1;
+}
+
 // Write an octree header to a file
 inline void writeOctreeHeader(const std::string &filename, const OctreeInfo &i){
 	ofstream outfile;
@@ -79,6 +180,14 @@ inline void writeOctreeHeader(const std::string &filename, const OctreeInfo &i){
 	outfile << "gridlength " << i.gridlength << endl;
 	outfile << "n_nodes " << i.n_nodes << endl;
 	outfile << "n_data " << i.n_data << endl;
+	if (i.format == FORMAT_ESVO) { outfile << "format esvo" << endl; } // absent means standard nodes
+	if (i.dag) { outfile << "dag 1" << endl; } // absent means a tree
+	if (i.layout == LAYOUT_BREADTH) { // absent means depth-first
+		outfile << "layout breadth" << endl;
+		outfile << "level_offsets " << i.level_offsets.size(); // amount of levels, then the first node of every level
+		for (size_t l = 0; l < i.level_offsets.size(); l++) { outfile << " " << i.level_offsets[l]; }
+		outfile << endl;
+	}
 	outfile << "END" << endl;
 	outfile.close();
 }
@@ -101,6 +210,10 @@ inline int parseOctreeHeader(const std::string &filename, OctreeInfo &i){
 		else if (line.compare("gridlength") == 0) {headerfile >> i.gridlength;}
 		else if (line.compare("n_nodes") == 0) {headerfile >> i.n_nodes;}
 		else if (line.compare("n_data") == 0) {headerfile >> i.n_data;}
+		else if (line.compare("format") == 0) {headerfile >> line; i.format = (line.compare("esvo") == 0) ? FORMAT_ESVO : FORMAT_STANDARD;}
+		else if (line.compare("dag") == 0) {headerfile >> i.dag;}
+		else if (line.compare("layout") == 0) {headerfile >> line; i.layout = (line.compare("breadth") == 0) ? LAYOUT_BREADTH : LAYOUT_DEPTH;}
+		else if (line.compare("level_offsets") == 0) {size_t n = 0; headerfile >> n; i.level_offsets.resize(n); for (size_t l = 0; l < n; l++) {headerfile >> i.level_offsets[l];}}
 		else { cout << "  unrecognized keyword [" << line << "], skipping" << endl;
 		char c; do { c = headerfile.get(); } while(headerfile.good() && (c != '\n'));
 		}
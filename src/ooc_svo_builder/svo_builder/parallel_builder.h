@@ -0,0 +1,236 @@
+#ifndef PARALLEL_BUILDER_H_
+#define PARALLEL_BUILDER_H_
+
+#include <vector>
+#include <omp.h>
+#include "morton.h"
+#include "Node.h"
+#include "lod_filter.h"
+
+using namespace std;
+
+// Level-synchronous parallel construction of a complete SVO subtree from a sorted array of morton codes.
+// The node order is identical to the one the streaming OctreeBuilder produces: a node's children block
+// is written right after the blocks of all its descendants (post-order), so the output is byte-compatible.
+
+// Subtrees are built with partition-local indices, so they can be built independently and rebased when merged:
+// children_base is relative to the start of the subtree's node stream, data indices below LOCAL_DATA_BASE
+// refer to the shared NULL (0) and white (1) voxels, LOCAL_DATA_BASE + i is entry i of the subtree's data stream.
+#define LOCAL_DATA_BASE 2
+
+// A partition's subtree: its sorted voxels, and the node and data streams built from them
+template <typename Payload>
+struct PartitionSubtree {
+	mort_t morton_start; // first morton code of the subtree
+	int depth; // levels below the root: the subtree spans 8^depth morton codes
+	vector<mort_t> codes; // sorted, unique morton codes of the voxels in this partition
+	vector< Node<Payload> > nodes; // all nodes except the root, in file order
+	vector<VoxelData> data; // leaf payloads (payload mode only), followed by the refined data of the upper levels
+	Node<Payload> root;
+
+	PartitionSubtree() : morton_start(0), depth(0) {}
+};
+
+// Parallel exclusive prefix sum of in[0..n) into out[0..n) (in and out may be the same array), returns the total
+template <typename T>
+inline T parallelExclusiveScan(const T* in, T* out, const size_t n){
+	vector<T> partial(omp_get_max_threads() + 1, 0);
+	int n_threads = 1;
+#pragma omp parallel
+	{
+		const int tid = omp_get_thread_num();
+#pragma omp single
+		n_threads = omp_get_num_threads(); // can be less than we asked for, when nested in another parallel region
+		const size_t chunk = (n + n_threads - 1) / n_threads;
+		const size_t begin = min(n, chunk * tid);
+		const size_t end = min(n, begin + chunk);
+		T sum = 0;
+		for (size_t i = begin; i < end; i++){ sum += in[i]; }
+		partial[tid + 1] = sum;
+#pragma omp barrier
+#pragma omp single
+		for (int t = 1; t <= n_threads; t++){ partial[t] += partial[t - 1]; }
+		sum = partial[tid];
+		for (size_t i = begin; i < end; i++){
+			T v = in[i];
+			out[i] = sum;
+			sum += v;
+		}
+	}
+	return partial[n_threads];
+}
+
+// One level of a subtree under construction
+struct SubtreeLevel {
+	vector<mort_t> codes; // sorted, unique morton codes of the nodes on this level
+	vector<size_t> first; // index of the first child on the level below (one extra sentinel entry)
+	vector<size_t> written; // amount of nodes written for the subtree of each node
+	vector<size_t> base; // start of the output region of the subtree of each node
+	vector<size_t> pos; // output position of each node
+	vector<VoxelData> refined; // data refined from the children (only when generating levels)
+	vector<size_t> coverage; // amount of leafs below each node (only when generating levels)
+};
+
+// LOD pass over the levels of a subtree: filter the data of every level from the level below, level by level on all cores.
+// The leafs (level 0) have their payload in leaf_data, the other levels get their data in refined.
+inline void filterSubtreeLevels(vector<SubtreeLevel> &levels, const VoxelData* leaf_data, const LodFilter lod_filter){
+	for (size_t l = 1; l < levels.size(); l++){
+		SubtreeLevel &lvl = levels[l];
+		const SubtreeLevel &below = levels[l - 1];
+		const VoxelData* below_data = (l == 1) ? leaf_data : &below.refined[0];
+		lvl.refined.resize(lvl.first.size() - 1);
+		lvl.coverage.resize(lvl.first.size() - 1);
+#pragma omp parallel for
+		for (long long p = 0; p < (long long)lvl.refined.size(); p++){
+			const size_t first = lvl.first[p];
+			const int count = (int)(lvl.first[p + 1] - first);
+			size_t coverage[8];
+			size_t total = 0;
+			for (int c = 0; c < count; c++){
+				coverage[c] = (l == 1) ? 1 : below.coverage[first + c];
+				total += coverage[c];
+			}
+			lvl.refined[p] = filterVoxelData(lod_filter, below_data + first, coverage, count);
+			lvl.coverage[p] = total;
+		}
+	}
+}
+
+// Build a complete subtree with 'depth' levels below its root from n sorted, unique morton codes (any random access container).
+// In binary mode leafs refer to the default voxel. With a payload, out_data holds the payload of every leaf on entry,
+// and the data of the upper levels, filtered with lod_filter, gets appended when generate_levels is set.
+// All nodes except the root are stored in out_nodes in file order, using partition-local indices (see above).
+// The root node is returned in root, ready to be handed to the upper levels of the tree.
+template <typename Payload, typename CodeArray>
+void buildSubtree(const CodeArray &leaf_codes, const size_t n, const int depth, const bool generate_levels, const LodFilter lod_filter,
+	vector< Node<Payload> > &out_nodes, vector<VoxelData> &out_data, Node<Payload> &root){
+	const bool refine = Payload::has_data && generate_levels;
+	out_nodes.clear();
+	root = Node<Payload>();
+	if (n == 0){ return; }
+	if (depth == 0){ // the subtree is a single voxel
+		root.data = Payload::has_data ? LOCAL_DATA_BASE : 1;
+		if (Payload::has_data){ root.setCache(out_data[0]); }
+		return;
+	}
+
+	vector<SubtreeLevel> levels(depth + 1);
+	levels[0].codes.resize(n);
+#pragma omp parallel for
+	for (long long i = 0; i < (long long)n; i++){
+		levels[0].codes[i] = leaf_codes[i];
+	}
+
+	// Bottom-up: derive each parent level with a parallel unique on (code >> 3)
+	vector<size_t> head;
+	for (int l = 0; l < depth; l++){
+		const vector<mort_t> &codes = levels[l].codes;
+		SubtreeLevel &parent = levels[l + 1];
+		const size_t n_level = codes.size();
+		head.resize(n_level);
+#pragma omp parallel for
+		for (long long i = 0; i < (long long)n_level; i++){
+			head[i] = (i == 0 || (codes[i] >> 3) != (codes[i - 1] >> 3)) ? 1 : 0;
+		}
+		// keep the head flags: after the scan, head[i] != head[i+1] marks the start of segment head[i]
+		vector<size_t> flags(head);
+		size_t n_parents = parallelExclusiveScan(&head[0], &head[0], n_level);
+		parent.codes.resize(n_parents);
+		parent.first.resize(n_parents + 1);
+		parent.first[n_parents] = n_level;
+#pragma omp parallel for
+		for (long long i = 0; i < (long long)n_level; i++){
+			if (flags[i]){
+				parent.codes[head[i]] = codes[i] >> 3;
+				parent.first[head[i]] = i;
+			}
+		}
+	}
+
+	// Bottom-up: count the nodes written for each subtree (its children block plus all blocks below it)
+	levels[0].written.assign(n, 0);
+	vector<size_t> data_base(depth + 1, LOCAL_DATA_BASE); // data index of the first node on each level
+	for (int l = 1; l <= depth; l++){
+		SubtreeLevel &lvl = levels[l];
+		const vector<size_t> &below_written = levels[l - 1].written;
+		lvl.written.resize(lvl.codes.size());
+#pragma omp parallel for
+		for (long long p = 0; p < (long long)lvl.codes.size(); p++){
+			size_t sum = lvl.first[p + 1] - lvl.first[p];
+			for (size_t c = lvl.first[p]; c < lvl.first[p + 1]; c++){
+				sum += below_written[c];
+			}
+			lvl.written[p] = sum;
+		}
+		data_base[l] = data_base[l - 1] + levels[l - 1].codes.size();
+	}
+
+	// Separate LOD pass for the upper levels, their data gets appended to the data stream level by level
+	if (refine){
+		filterSubtreeLevels(levels, &out_data[0], lod_filter);
+		for (int l = 1; l <= depth; l++){
+			out_data.insert(out_data.end(), levels[l].refined.begin(), levels[l].refined.end());
+		}
+	}
+
+	// Top-down: place subtree regions with a segmented prefix sum and fill in the nodes at their final positions
+	out_nodes.resize(levels[depth].written[0]);
+	levels[depth].base.assign(1, 0);
+	for (int l = depth; l >= 1; l--){
+		SubtreeLevel &lvl = levels[l];
+		SubtreeLevel &below = levels[l - 1];
+		below.base.resize(below.codes.size());
+		below.pos.resize(below.codes.size());
+#pragma omp parallel for
+		for (long long p = 0; p < (long long)lvl.codes.size(); p++){
+			const size_t n_children = lvl.first[p + 1] - lvl.first[p];
+			const size_t block = lvl.base[p] + lvl.written[p] - n_children; // own children block comes last
+			Node<Payload> node = Node<Payload>();
+			node.children_base = block;
+			if (refine){
+				node.data = data_base[l] + p;
+				node.setCache(lvl.refined[p]);
+				node.setCoverage(lvl.coverage[p]);
+			}
+			size_t run = lvl.base[p];
+			for (size_t c = lvl.first[p]; c < lvl.first[p + 1]; c++){
+				const size_t rank = c - lvl.first[p];
+				node.children_offset[below.codes[c] & 7] = (char)rank;
+				below.base[c] = run;
+				below.pos[c] = block + rank;
+				run += below.written[c];
+				if (l == 1){ // leaves: refer to their own payload, or to the default voxel
+					Node<Payload> &leaf = out_nodes[block + rank];
+					leaf = Node<Payload>();
+					if (Payload::has_data){
+						leaf.data = LOCAL_DATA_BASE + c;
+						leaf.setCache(out_data[c]);
+					}
+					else {
+						leaf.data = 1;
+					}
+				}
+			}
+			if (l == depth){
+				root = node;
+			}
+			else {
+				out_nodes[lvl.pos[p]] = node;
+			}
+		}
+		// free what we no longer need on this level
+		vector<mort_t>().swap(lvl.codes);
+		vector<size_t>().swap(lvl.first);
+		vector<VoxelData>().swap(lvl.refined);
+		vector<size_t>().swap(lvl.coverage);
+	}
+}
+
+// Rebase a node built with partition-local indices onto the global node and data streams
+template <typename Payload>
+inline void rebaseNode(Node<Payload> &node, const size_t node_offset, const size_t data_offset){
+	if (!node.isLeaf()){ node.children_base += node_offset; }
+	if (node.data >= LOCAL_DATA_BASE){ node.data += data_offset; }
+}
+
+#endif // PARALLEL_BUILDER_H_
@@ -1,11 +1,11 @@
 #include "partitioner.h"
+#include <sstream>
 
 using namespace std;
 using namespace trimesh;
 
-// Fiddle with buffer sizes here: these are defined as number of triangles
+// Fiddle with buffer sizes here: these are defined as number of triangles (output buffer and chunk size: see partitioner.h)
 #define input_buffersize 8192
-#define output_buffersize 8192
 
 // Estimate the optimal amount of partitions we need, given the requested gridsize and the overall memory limit.
 size_t estimate_partitions(const size_t gridsize, const size_t memory_limit){
@@ -26,23 +26,187 @@ size_t estimate_partitions(const size_t gridsize, const size_t memory_limit){
 	return numpartitions;
 }
 
+// Partition boundaries along an axis: partition k spans grid cells [k*side, (k+1)*side), in world coordinates
+PartitionGrid::PartitionGrid(const size_t gridsize, const size_t n_partitions, const float unitlength) : parts_per_axis(1){
+	while (parts_per_axis * parts_per_axis * parts_per_axis < n_partitions){
+		parts_per_axis *= 2;
+	}
+	const size_t side = gridsize / parts_per_axis;
+	lo.resize(parts_per_axis);
+	hi.resize(parts_per_axis);
+	for (size_t k = 0; k < parts_per_axis; k++){
+		lo[k] = (unsigned int)(k * side) * unitlength;
+		hi[k] = (unsigned int)((k + 1) * side) * unitlength;
+	}
+}
+
+// Find the range of partitions (per axis, inclusive) a bounding box overlaps, returns false if there are none.
+// Boxes overlap when they do on every axis, so this gives the same partitions as intersectBoxBox with each of them.
+inline bool PartitionGrid::overlap(const AABox<vec3> &bbox, uivec3 &first, uivec3 &last) const{
+	for (int a = 0; a < 3; a++){
+		// first partition not completely below the box, last partition not completely above it
+		first[a] = (unsigned int)(lower_bound(hi.begin(), hi.end(), bbox.min[a]) - hi.begin());
+		last[a] = (unsigned int)(upper_bound(lo.begin(), lo.end(), bbox.max[a]) - lo.begin());
+		if (first[a] >= last[a]){ return false; }
+		last[a]--;
+	}
+	return true;
+}
+
+// Partition number of the partition at the given partition grid coordinates
+inline size_t PartitionGrid::index(const unsigned int x, const unsigned int y, const unsigned int z) const{
+	return (size_t)mortonEncode_LUT(z, y, x); // same axis order as the voxelizer
+}
+
+// Find the partitions a bounding box overlaps, without duplicates
+void PartitionGrid::partitions(const AABox<vec3> &bbox, vector<size_t> &parts) const{
+	parts.clear();
+	uivec3 first, last;
+	if (!overlap(bbox, first, last)){ return; }
+	for (unsigned int x = first[0]; x <= last[0]; x++){
+		for (unsigned int y = first[1]; y <= last[1]; y++){
+			for (unsigned int z = first[2]; z <= last[2]; z++){
+				const size_t c = index(x, y, z);
+				parts.push_back(owner.empty() ? c : owner[c]);
+			}
+		}
+	}
+	if (!owner.empty() && parts.size() > 1){ // neighbouring cells mostly belong to the same partition
+		sort(parts.begin(), parts.end());
+		parts.erase(unique(parts.begin(), parts.end()), parts.end());
+	}
+}
+
+// Partition cache: partitionings are kept after a build, and reused by the next build of the same source for the same grid size
+// and (requested) partition count. The <source>.tripcache file lists them, one per line: gridsize, partition count, adaptive,
+// container, index files and the .trip header. The header holds a hash of the source triangles, so changed sources are detected.
+
+// Hash the source triangles: 64-bit FNV-1a over 8-byte words, per block of triangles on all cores, blocks combined in order
+unsigned long long hashTriangles(const TriReaderIter *reader){
+	const unsigned long long fnv_offset = 14695981039346656037ULL;
+	const unsigned long long fnv_prime = 1099511628211ULL;
+	const TriangleSpan tris = reader->span();
+	const size_t n = tris.size();
+	const size_t block = 65536;
+	const size_t n_blocks = (n + block - 1) / block;
+	vector<unsigned long long> block_hash(n_blocks);
+#pragma omp parallel for
+	for (long long b = 0; b < (long long)n_blocks; b++){
+		const size_t first = b * block;
+		const size_t count = min(block, n - first);
+		const unsigned char* bytes = (const unsigned char*) &tris[first];
+		const size_t n_bytes = count * sizeof(Triangle);
+		unsigned long long h = fnv_offset;
+		size_t i = 0;
+		for (; i + sizeof(unsigned long long) <= n_bytes; i += sizeof(unsigned long long)){
+			unsigned long long word;
+			memcpy(&word, bytes + i, sizeof(word));
+			h = (h ^ word) * fnv_prime;
+		}
+		for (; i < n_bytes; i++){
+			h = (h ^ bytes[i]) * fnv_prime;
+		}
+		block_hash[b] = h;
+	}
+	unsigned long long h = (fnv_offset ^ n) * fnv_prime;
+	for (size_t b = 0; b < n_blocks; b++){
+		h = (h ^ block_hash[b]) * fnv_prime;
+	}
+	return (h == 0) ? 1 : h; // 0 means unknown
+}
+
+// Look for a cached partitioning in the .tripcache file of the source, and check that it's still complete and made from the same triangles
+bool findCachedPartitions(const TriInfo& tri_info, const size_t n_partitions, const size_t gridsize, const bool container, const bool adaptive,
+	const bool index_files, const unsigned long long source_hash, TripInfo &trip_info){
+	ifstream cache((tri_info.base_filename + string(".tripcache")).c_str());
+	size_t c_gridsize, c_partitions;
+	bool c_adaptive, c_container, c_index_files;
+	string header;
+	while (cache >> c_gridsize >> c_partitions >> c_adaptive >> c_container >> c_index_files >> header){
+		if (c_gridsize != gridsize || c_partitions != n_partitions || c_adaptive != adaptive || c_container != container || c_index_files != index_files){ continue; }
+		if (!file_exists(header) || parseTripHeader(header, trip_info) != 1){ break; }
+		if (trip_info.source_hash != source_hash){
+			cout << "  cached partitioning " << header << " was made from other triangles" << endl;
+			return false;
+		}
+		if (trip_info.gridsize != gridsize || trip_info.container != container || trip_info.part_starts.empty() == adaptive
+			|| (trip_info.index_bytes != 0) != index_files || !trip_info.filesComplete()){
+			cout << "  cached partitioning " << header << " is incomplete" << endl;
+			return false;
+		}
+		return true;
+	}
+	return false;
+}
+
+// Record a partitioning in the .tripcache file of the source, and put the hash in its header.
+// Older entries for the same settings, or with the same header (which we just overwrote), are dropped.
+void cachePartitions(const TriInfo& tri_info, const size_t n_partitions, const size_t gridsize, const bool container, const bool adaptive,
+	const bool index_files, const TripInfo &trip_info){
+	const string cache_filename = tri_info.base_filename + string(".tripcache");
+	const string trip_header = trip_info.base_filename + string(".trip");
+	stringstream entries;
+	ifstream cache(cache_filename.c_str());
+	size_t c_gridsize, c_partitions;
+	bool c_adaptive, c_container, c_index_files;
+	string header;
+	while (cache >> c_gridsize >> c_partitions >> c_adaptive >> c_container >> c_index_files >> header){
+		if ((c_gridsize != gridsize || c_partitions != n_partitions || c_adaptive != adaptive || c_container != container || c_index_files != index_files)
+			&& header != trip_header){
+			entries << c_gridsize << " " << c_partitions << " " << c_adaptive << " " << c_container << " " << c_index_files << " " << header << endl;
+		}
+	}
+	cache.close();
+	writeTripHeader(trip_header, trip_info);
+	ofstream out(cache_filename.c_str());
+	out << entries.str() << gridsize << " " << n_partitions << " " << adaptive << " " << container << " " << index_files << " " << trip_header << endl;
+}
+
+// Bounding box (in grid coordinates) of the voxels in the morton range [start, end): the union of its aligned blocks
+void mortonRangeBox(const mort_t start, const mort_t end, AABox<uivec3> &bbox_grid){
+	AABox<uivec3> block;
+	for (mort_t pos = start; pos < end;){
+		const mort_t size = mortonBlockSize(pos, end);
+		mortonDecode(pos, block.min[2], block.min[1], block.min[0]);
+		mortonDecode(pos + size - 1, block.max[2], block.max[1], block.max[0]); // -1, because z-curve skips to first voxel of next block
+		if (pos == start){
+			bbox_grid = block;
+		}
+		else {
+			for (int a = 0; a < 3; a++){
+				bbox_grid.min[a] = min(bbox_grid.min[a], block.min[a]);
+				bbox_grid.max[a] = max(bbox_grid.max[a], block.max[a]);
+			}
+		}
+		pos += size;
+	}
+}
+
 // Remove the temporary .trip files we made
 void removeTripFiles(const TripInfo &trip_info){
 	// remove header file
 	string filename = trip_info.base_filename + string(".trip");
 	remove(filename.c_str());
 	// remove tripdata files
+	if (trip_info.container){
+		remove(trip_info.getPartitionFilename(0).c_str());
+		return;
+	}
 	for (size_t i = 0; i < trip_info.n_partitions; i++){
-		filename = trip_info.base_filename + string("_") + val_to_string(i) + string(".tripdata");
+		filename = trip_info.getPartitionFilename(i);
 		remove(filename.c_str());
 	}
 }
 
-// Create n Buffers for a total gridsize, store them in the given vector, use tri_info for filename information
-void createBuffers(const TriInfo& tri_info, const size_t n_partitions, const size_t gridsize, vector<Buffer*> &buffers){
+// Create a Buffer for every partition (partition i spans morton codes [starts[i], starts[i+1])) for a total gridsize,
+// store them in the given vector, use tri_info for filename information. The buffers hand their batches to the writer.
+// With a container file, the buffers write to their extent in it instead, starting at the given offsets.
+void createBuffers(const TriInfo& tri_info, const vector<size_t> &starts, const size_t gridsize, vector<Buffer*> &buffers, PartitionWriter* writer,
+	FILE* container = NULL, const size_t* offsets = NULL){
+	const size_t n_partitions = starts.size() - 1;
+	const size_t buffersize = partitionBlockSize(n_partitions, output_buffersize);
 	buffers.reserve(n_partitions);
 	float unitlength = (tri_info.mesh_bbox.max[0] - tri_info.mesh_bbox.min[0]) / (float)gridsize;
-    mort_t morton_part = (gridsize*gridsize*gridsize) / n_partitions;
 
 	AABox<uivec3> bbox_grid;
 	AABox<vec3> bbox_world;
@@ -50,8 +214,7 @@ void createBuffers(const TriInfo& tri_info, const size_t n_partitions, const siz
 
 	for (size_t i = 0; i < n_partitions; i++){
 		// compute world bounding box
-		mortonDecode(morton_part*i, bbox_grid.min[2], bbox_grid.min[1], bbox_grid.min[0]);
-		mortonDecode((morton_part*(i + 1)) - 1, bbox_grid.max[2], bbox_grid.max[1], bbox_grid.max[0]); // -1, because z-curve skips to first block of next partition
+		mortonRangeBox(starts[i], starts[i + 1], bbox_grid);
 		bbox_world.min[0] = bbox_grid.min[0] * unitlength;
 		bbox_world.min[1] = bbox_grid.min[1] * unitlength;
 		bbox_world.min[2] = bbox_grid.min[2] * unitlength;
@@ -62,7 +225,7 @@ void createBuffers(const TriInfo& tri_info, const size_t n_partitions, const siz
 		// output partition info
 		if (verbose){
 			cout << "Partitioning partition #" << i + 1 << " / " << n_partitions << " id: " << i << " ..." << endl;
-			cout << "  morton from " << morton_part*i << " to " << morton_part*(i + 1) << endl;
+			cout << "  morton from " << starts[i] << " to " << starts[i + 1] << endl;
 			cout << "  grid coordinates from (" << bbox_grid.min[0] << "," << bbox_grid.min[1] << "," << bbox_grid.min[2] << ") to ("
 				<< bbox_grid.max[0] << "," << bbox_grid.max[1] << "," << bbox_grid.max[2] << ")" << endl;
 			cout << "  worldspace coordinates from (" << bbox_world.min[0] << "," << bbox_world.min[1] << "," << bbox_world.min[2] << ") to ("
@@ -71,19 +234,21 @@ void createBuffers(const TriInfo& tri_info, const size_t n_partitions, const siz
 
 		// create buffer for partition
 		filename = tri_info.base_filename + val_to_string(gridsize) + string("_") + val_to_string(n_partitions) + string("_") + val_to_string(i) + string(".tripdata");
-		buffers[i] = new Buffer(filename, bbox_world, output_buffersize);
+		if (container){
+			buffers[i] = new Buffer(container, offsets[i], bbox_world, buffersize, writer);
+		}
+		else {
+			buffers[i] = new Buffer(filename, bbox_world, buffersize, writer);
+		}
 	}
 }
 
-// Handle the special case of just needing one partition
+// Handle the special case of just needing one partition: the voxelizer can work straight from the source triangles,
+// which are in memory already, so there's no need to write them to a partition file.
 TripInfo partition_one(const TriInfo& tri_info, const size_t gridsize){
-	// Just copy files
-	string src = tri_info.base_filename + string(".tridata");
-	string dst = tri_info.base_filename + val_to_string(gridsize) + string("_") + val_to_string(1) + string("_") + val_to_string(0) + string(".tripdata");
-	copy_file(src, dst);
-
 	// Write header
 	TripInfo trip_info = TripInfo(tri_info);
+	trip_info.in_core = true;
 	trip_info.part_tricounts.resize(1);
 	trip_info.part_tricounts[0] = tri_info.n_triangles;
 	trip_info.base_filename = tri_info.base_filename + val_to_string(gridsize) + string("_") + val_to_string(1);
@@ -96,10 +261,214 @@ TripInfo partition_one(const TriInfo& tri_info, const size_t gridsize){
 	return trip_info;
 }
 
-// Partition the mesh referenced by tri_info into n partitions for gridsize, and store information about the partitioning in trip_info
-TripInfo partition(const TriInfo& tri_info, const size_t n_partitions, const size_t gridsize, TriReaderIter *reader){
+// Density-adaptive partitioning. The voxelization cost of every cell of a fine grid is estimated from the triangles overlapping it:
+// a triangle costs 1 plus its area in voxels, spread evenly over its cells. The morton order of the cells is then cut into
+// ranges of about total / n_target cost, none longer than an equal partition, so every range still fits in the memory limit.
+// Returns the starts of the ranges (with the end of the grid as the last one), and fills in the cell owners of the grid.
+vector<size_t> adaptiveRanges(TriReaderIter *reader, PartitionGrid &grid, const size_t gridsize, const size_t n_target, const float unitlength){
+	const size_t n_cells = grid.parts_per_axis * grid.parts_per_axis * grid.parts_per_axis;
+	const size_t cell_length = (gridsize * gridsize * gridsize) / n_cells;
+	const size_t max_cells = n_cells / n_target; // cells in an equal partition
+	const double voxel_area = (double)unitlength * unitlength;
+	const int n_threads = omp_get_max_threads();
+
+	// triangle/area histogram over the cells, every thread has its own
+	vector< vector<double> > thread_cost(n_threads, vector<double>(n_cells, 0.0));
+	const TriangleSpan tris = reader->span();
+#pragma omp parallel for num_threads(n_threads)
+	for (long long t = 0; t < (long long)tris.size(); t++){
+		const Triangle &tri = tris[t];
+		AABox<vec3> bbox = computeBoundingBox(tri.v0, tri.v1, tri.v2);
+		uivec3 first, last;
+		if (!grid.overlap(bbox, first, last)){ continue; }
+		const double n = (double)(last[0] - first[0] + 1) * (last[1] - first[1] + 1) * (last[2] - first[2] + 1);
+		const double cost = (1.0 + 0.5 * len((tri.v1 - tri.v0) CROSS (tri.v2 - tri.v0)) / voxel_area) / n;
+		vector<double> &my_cost = thread_cost[omp_get_thread_num()];
+		for (unsigned int x = first[0]; x <= last[0]; x++){
+			for (unsigned int y = first[1]; y <= last[1]; y++){
+				for (unsigned int z = first[2]; z <= last[2]; z++){
+					my_cost[grid.index(x, y, z)] += cost;
+				}
+			}
+		}
+	}
+	vector<double> cell_cost(n_cells, 0.0);
+#pragma omp parallel for num_threads(n_threads)
+	for (long long c = 0; c < (long long)n_cells; c++){
+		for (int tid = 0; tid < n_threads; tid++){ cell_cost[c] += thread_cost[tid][c]; }
+	}
+	double total = 0;
+	for (size_t c = 0; c < n_cells; c++){ total += cell_cost[c]; }
+
+	// cut the morton line: start a new range when the next cell would push it over the target cost, or over the length limit
+	const double target = total / n_target;
+	vector<size_t> starts(1, 0);
+	grid.owner.resize(n_cells);
+	double range_cost = 0;
+	size_t range_cells = 0;
+	for (size_t c = 0; c < n_cells; c++){
+		if (range_cells == max_cells || (range_cells > 0 && range_cost + cell_cost[c] > target)){
+			starts.push_back(c * cell_length);
+			range_cost = 0;
+			range_cells = 0;
+		}
+		range_cost += cell_cost[c];
+		range_cells++;
+		grid.owner[c] = starts.size() - 1;
+	}
+	starts.push_back(n_cells * cell_length);
+
+	if (verbose){
+		cout << "  estimated cost " << total << " over " << n_cells << " cells of " << cell_length << " voxels, target " << target
+			<< " per partition: " << starts.size() - 1 << " partitions" << endl;
+	}
+	return starts;
+}
+
+// Build the in-core partition index in two passes over the source triangles: count, then fill in. Both passes split the triangles
+// in the same contiguous slices, and the slices of a partition follow each other, so it gets its triangles in input order.
+void buildPartitionIndex(TriReaderIter *reader, const PartitionGrid &grid, const size_t n_partitions, const int n_slices, PartitionIndex &index){
+	const TriangleSpan tris = reader->span();
+	const size_t n = tris.size();
+	const size_t slice = (n + n_slices - 1) / n_slices;
+	vector< vector<size_t> > cursors(n_slices, vector<size_t>(n_partitions, 0));
+#pragma omp parallel for num_threads(n_slices) schedule(static, 1)
+	for (int s = 0; s < n_slices; s++){
+		vector<size_t> parts;
+		for (size_t t = min(n, s * slice); t < min(n, (s + 1) * slice); t++){
+			const Triangle &tri = tris[t];
+			grid.partitions(computeBoundingBox(tri.v0, tri.v1, tri.v2), parts);
+			for (size_t k = 0; k < parts.size(); k++){ cursors[s][parts[k]]++; }
+		}
+	}
+	index.offsets.resize(n_partitions + 1);
+	size_t total = 0;
+	for (size_t j = 0; j < n_partitions; j++){
+		index.offsets[j] = total;
+		for (int s = 0; s < n_slices; s++){
+			const size_t count = cursors[s][j];
+			cursors[s][j] = total;
+			total += count;
+		}
+	}
+	index.offsets[n_partitions] = total;
+	index.triangles.resize(total);
+#pragma omp parallel for num_threads(n_slices) schedule(static, 1)
+	for (int s = 0; s < n_slices; s++){
+		vector<size_t> parts;
+		for (size_t t = min(n, s * slice); t < min(n, (s + 1) * slice); t++){
+			const Triangle &tri = tris[t];
+			grid.partitions(computeBoundingBox(tri.v0, tri.v1, tri.v2), parts);
+			for (size_t k = 0; k < parts.size(); k++){ index.triangles[cursors[s][parts[k]]++] = (unsigned int)t; }
+		}
+	}
+}
+
+// Write a list of triangle indices to a file, in one go
+void writeIndices(const string &filename, const unsigned int* indices, const size_t n){
+	FILE* file = fopen(filename.c_str(), "wb");
+	if (file == NULL || (n > 0 && fwrite(indices, sizeof(unsigned int), n, file) != n)){
+		cout << "Error: could not write " << n << " triangle indices to " << filename << "." << endl;
+		exit(1);
+	}
+	fclose(file);
+}
+
+// Write the partition index out as index-only partition files: every partition file (or extent of the container) holds the
+// indices of its triangles in the source, instead of the triangles themselves. The index is in CSR layout already,
+// so every partition file gets written in one go, and a container is just the whole index.
+void writeIndexFiles(const PartitionIndex &index, TripInfo &trip_info){
+	trip_info.index_bytes = sizeof(unsigned int);
+	if (trip_info.container){
+		trip_info.part_offsets.assign(index.offsets.begin(), index.offsets.end() - 1);
+		writeIndices(trip_info.getPartitionFilename(0), index.triangles.empty() ? NULL : &index.triangles[0], index.triangles.size());
+		return;
+	}
+	for (size_t i = 0; i < trip_info.n_partitions; i++){
+		if (trip_info.part_tricounts[i] > 0){
+			writeIndices(trip_info.getPartitionFilename(i), &index.triangles[index.offsets[i]], trip_info.part_tricounts[i]);
+		}
+	}
+}
+
+// Bin the triangles of a reader over the partitions. The reader hands them out in blocks of up to a chunk, without copying them.
+// Every thread bins a contiguous slice of a block in its own bin: one array, sorted by partition in two passes like the partition
+// index (count, then fill in), so it never holds more than the slice's triangles, however many partitions there are.
+// The writer stage then hands the bins to the Buffers thread by thread, so every partition still gets its triangles in input order.
+template <typename Reader>
+static void binTriangles(Reader* reader, const PartitionGrid &grid, const size_t n_partitions, const int n_threads, vector<Buffer*> &buffers){
+	vector< vector<Triangle> > bins(n_threads);
+	vector< vector<size_t> > cursors(n_threads, vector<size_t>(n_partitions, 0)); // per partition: triangle count, then end in the bin
+	vector< vector<size_t> > touched(n_threads); // partitions that got triangles in each thread's bin, in the order of the bin
+	size_t first = 0; // index of the first triangle of the block in the source
+	while (true) {
+		// get a block
+		part_algo_timer.stop(); part_io_in_timer.start(); // TIMING
+		const TriangleSpan block = reader->nextBlock(partition_chunksize);
+		part_io_in_timer.stop(); part_algo_timer.start(); // TIMING
+		if (block.empty()) { break; }
+		const size_t n = block.size();
+
+		// bin it
+#pragma omp parallel num_threads(n_threads)
+		{
+			const int tid = omp_get_thread_num();
+			const size_t slice = (n + omp_get_num_threads() - 1) / omp_get_num_threads();
+			const size_t begin = min(n, slice * tid);
+			const size_t end = min(n, begin + slice);
+			vector<Triangle> &my_bin = bins[tid];
+			vector<size_t> &my_cursors = cursors[tid];
+			vector<size_t> parts;
+			for (size_t t = begin; t < end; t++) {
+				const Triangle &tri = block[t];
+				AABox<vec3> bbox = computeBoundingBox(tri.v0, tri.v1, tri.v2); // compute bounding box
+				grid.partitions(bbox, parts); // only visit the partitions the triangle's bounding box overlaps
+				for (size_t k = 0; k < parts.size(); k++){
+					if (my_cursors[parts[k]]++ == 0) { touched[tid].push_back(parts[k]); }
+				}
+			}
+			size_t total = 0;
+			for (size_t k = 0; k < touched[tid].size(); k++) {
+				const size_t count = my_cursors[touched[tid][k]];
+				my_cursors[touched[tid][k]] = total;
+				total += count;
+			}
+			my_bin.resize(total);
+			for (size_t t = begin; t < end; t++) {
+				const Triangle &tri = block[t];
+				grid.partitions(computeBoundingBox(tri.v0, tri.v1, tri.v2), parts);
+				for (size_t k = 0; k < parts.size(); k++){
+					Triangle &binned = my_bin[my_cursors[parts[k]]++];
+					binned = tri;
+					binned.idx = (int)(first + t); // partition files keep the index of every triangle in the source
+				}
+			}
+		}
+		first += n;
+
+		// writer stage
+		for (int tid = 0; tid < n_threads; tid++) {
+			size_t bin_first = 0;
+			for (size_t k = 0; k < touched[tid].size(); k++) {
+				const size_t j = touched[tid][k];
+				buffers[j]->addTriangles(&bins[tid][bin_first], cursors[tid][j] - bin_first);
+				bin_first = cursors[tid][j];
+				cursors[tid][j] = 0;
+			}
+			touched[tid].clear();
+		}
+	}
+}
+
+// Partition the mesh referenced by tri_info for gridsize, and store information about the partitioning in trip_info.
+// The mesh gets n equal partitions, or with adaptive partitioning, ranges of balanced cost which are at most that size.
+// With an index, the partitions stay in memory as lists of source triangles, nothing gets written but the .trip header.
+// With index files, those lists get written to the partition files instead of the triangles.
+// With a streamed source, the triangles are read from the .tridata file while they're binned, the reader isn't used.
+TripInfo partition(const TriInfo& tri_info, const size_t n_equal, const size_t gridsize, TriReaderIter *reader, const bool container, const bool adaptive,
+	const bool index_files, PartitionIndex* index, const bool stream_source){
 	// Special case: just one partition
-	if (n_partitions == 1) {
+	if (n_equal == 1) {
 		return partition_one(tri_info, gridsize);
 	}
 
@@ -109,21 +478,100 @@ TripInfo partition(const TriInfo& tri_info, const size_t n_partitions, const siz
 	part_io_in_timer.stop(); // TIMING
 
 	part_algo_timer.start(); // TIMING
-	// Create Mortonbuffers
+	const float unitlength = (tri_info.mesh_bbox.max[0] - tri_info.mesh_bbox.min[0]) / (float)gridsize;
+	vector<size_t> starts;
+	PartitionGrid grid(gridsize, adaptive ? adaptiveCells(n_equal, gridsize) : n_equal, unitlength);
+	if (adaptive){
+		starts = adaptiveRanges(reader, grid, gridsize, n_equal, unitlength);
+	}
+	else {
+		for (size_t j = 0; j <= n_equal; j++){ starts.push_back(j * ((gridsize * gridsize * gridsize) / n_equal)); }
+	}
+	const size_t n_partitions = starts.size() - 1;
+	const int n_threads = omp_get_max_threads();
+	string base_filename = tri_info.base_filename + val_to_string(gridsize) + string("_") + val_to_string(n_partitions);
+
+	// In-core partitions or index files: just the index
+	if (index || index_files){
+		PartitionIndex file_index;
+		PartitionIndex &part_index = index ? *index : file_index;
+		buildPartitionIndex(reader, grid, n_partitions, n_threads, part_index);
+		part_algo_timer.stop(); // TIMING
+		part_io_out_timer.start(); // TIMING
+		TripInfo trip_info = TripInfo(tri_info);
+		trip_info.in_core = (index != NULL);
+		trip_info.container = container && !trip_info.in_core;
+		trip_info.part_tricounts.resize(n_partitions);
+		for (size_t j = 0; j < n_partitions; j++){
+			trip_info.part_tricounts[j] = part_index.offsets[j + 1] - part_index.offsets[j];
+		}
+		if (adaptive){
+			trip_info.part_starts = starts;
+		}
+		trip_info.base_filename = base_filename;
+		trip_info.gridsize = gridsize;
+		trip_info.n_partitions = n_partitions;
+		if (!trip_info.in_core){
+			writeIndexFiles(part_index, trip_info);
+		}
+		writeTripHeader(trip_info.base_filename + string(".trip"), trip_info);
+		part_io_out_timer.stop(); // TIMING
+		return trip_info;
+	}
+
+	// Container: all partitions go in one file, every partition gets an extent of exactly the right size.
+	// The triangles are all in memory already, so we count them per partition in a quick pass first.
+	FILE* container_file = NULL;
+	vector<size_t> offsets;
+	if (container){
+		vector< vector<size_t> > counts(n_threads, vector<size_t>(n_partitions, 0));
+		const TriangleSpan tris = reader->span();
+#pragma omp parallel num_threads(n_threads)
+		{
+			vector<size_t> parts;
+#pragma omp for
+			for (long long t = 0; t < (long long)tris.size(); t++){
+				const Triangle &tri = tris[t];
+				grid.partitions(computeBoundingBox(tri.v0, tri.v1, tri.v2), parts);
+				for (size_t k = 0; k < parts.size(); k++){
+					counts[omp_get_thread_num()][parts[k]]++;
+				}
+			}
+		}
+		offsets.resize(n_partitions + 1); // the end of the last extent too
+		size_t total = 0;
+		for (size_t j = 0; j < n_partitions; j++){
+			offsets[j] = total;
+			for (int tid = 0; tid < n_threads; tid++){ total += counts[tid][j]; }
+		}
+		offsets[n_partitions] = total;
+
+		part_algo_timer.stop(); part_io_out_timer.start(); // TIMING
+		string container_filename = base_filename + string(".tripdata");
+		container_file = fopen(container_filename.c_str(), "wb");
+		if (container_file == NULL || !preallocate_file(container_file, total * TRIANGLE_SIZE * sizeof(float))){
+			cout << "Error: could not create " << container_filename << " for " << total << " triangles." << endl;
+			exit(1);
+		}
+		part_io_out_timer.stop(); part_algo_timer.start(); // TIMING
+	}
+
+	// Create Mortonbuffers, which write their batches in the background
+	PartitionWriter writer;
 	vector<Buffer*> buffers;
-	createBuffers(tri_info, n_partitions, gridsize, buffers);
-    int i=0;
-    while (reader->hasNext()) {
-		Triangle t;
-		part_algo_timer.stop(); part_io_in_timer.start(); // TIMING
-        reader->getTriangle(t);
-        t.idx = i;
-		part_io_in_timer.stop(); part_algo_timer.start(); // TIMING
-		AABox<vec3> bbox = computeBoundingBox(t.v0, t.v1, t.v2); // compute bounding box
-		for (int j = 0; j < n_partitions; j++){ // Test against all partitions
-			buffers[j]->processTriangle(t, bbox);
+	createBuffers(tri_info, starts, gridsize, buffers, &writer, container_file, container ? &offsets[0] : NULL);
+
+	// Bin the triangles: straight from the .tridata file if the source is streamed, read ahead in the background while we bin
+	if (stream_source){
+		TriReader stream(tri_info.base_filename + string(".tridata"), tri_info.n_triangles, partition_chunksize, 0, tri_info.quantization,
+			tri_info.quantization ? quantizationStep(tri_info.mesh_bbox, tri_info.quantization) : 0, partition_read_ahead);
+		binTriangles(&stream, grid, n_partitions, n_threads, buffers);
+		if (verbose){
+			cout << "  read-ahead: " << tri_info.n_triangles << " triangles read in " << stream.read_seconds << " s, waited " << stream.wait_seconds << " s for them" << endl;
 		}
-        i++;
+	}
+	else {
+		binTriangles(reader, grid, n_partitions, n_threads, buffers);
 	}
 	part_algo_timer.stop(); // TIMING
 	part_io_out_timer.start(); // TIMING
@@ -135,11 +583,32 @@ TripInfo partition(const TriInfo& tri_info, const size_t n_partitions, const siz
 	trip_info.part_tricounts.resize(n_partitions);
 	for (size_t j = 0; j < n_partitions; j++){
 		trip_info.part_tricounts[j] = buffers[j]->n_triangles;
+		if (container_file && buffers[j]->n_triangles != offsets[j + 1] - offsets[j]){ // the Buffer would have written outside its extent
+			cout << "Error: partition " << j << " got " << buffers[j]->n_triangles << " triangles, but its extent in the container holds "
+				<< offsets[j + 1] - offsets[j] << "." << endl;
+			exit(1);
+		}
 		delete buffers[j];
 	}
+	writer.finish(); // wait for the last batches
+	if (container_file && fclose(container_file) != 0){ writer.failed_writes++; }
+	if (writer.failed_writes > 0){ // the .trip header would claim triangles that aren't in the partition files
+		cout << "Error: " << writer.failed_writes << " writes to the partition files failed, they are incomplete." << endl;
+		exit(1);
+	}
+	if (verbose){
+		cout << "  partition writer: " << writer.bytes_written / 1024 / 1024 << " Mb in " << writer.write_seconds << " s on " << PARTITION_WRITER_THREADS << " threads" << endl;
+	}
+	if (container_file){
+		trip_info.container = true;
+		trip_info.part_offsets.assign(offsets.begin(), offsets.end() - 1);
+	}
+	if (adaptive){
+		trip_info.part_starts = starts;
+	}
 
 	// Write trip header
-	trip_info.base_filename = tri_info.base_filename + val_to_string(gridsize) + string("_") + val_to_string(n_partitions);
+	trip_info.base_filename = base_filename;
 	std::string header = trip_info.base_filename + string(".trip");
 	trip_info.gridsize = gridsize;
 	trip_info.n_partitions = n_partitions;
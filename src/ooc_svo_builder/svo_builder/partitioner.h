@@ -1,6 +1,7 @@
 #ifndef PARTITIONER_H_
 #define PARTITIONER_H_
 
+#include <omp.h>
 #include <tri_tools.h>
 #include <trip_tools.h>
 #include <file_tools.h>
@@ -12,9 +13,49 @@
 
 typedef Vec<3, unsigned int> uivec3;
 
+// Fiddle with buffer sizes here: these are defined as number of triangles (the output buffers grow with fewer partitions, see PartitionWriter.h)
+#define output_buffersize 8192
+// Triangles are read in chunks of this size, which get binned over the partitions by all threads together
+#define partition_chunksize 65536
+// A streamed source is read ahead into a ring of this many chunks
+#define partition_read_ahead 4
+
+// The partitions of a grid are the cells of a coarser grid (8^k partitions, 2^k per axis), numbered in morton order.
+// This finds the partitions a bounding box overlaps directly, instead of testing it against every partition.
+// With adaptive partitioning, the cells are finer than the partitions: every partition owns a morton range of cells.
+struct PartitionGrid {
+	size_t parts_per_axis;
+	vector<float> lo; // world coordinates of the partition boundaries, exactly as the Buffers compute them
+	vector<float> hi;
+	vector<size_t> owner; // partition of every cell (empty: every cell is a partition)
+
+	PartitionGrid(const size_t gridsize, const size_t n_partitions, const float unitlength);
+	bool overlap(const AABox<vec3> &bbox, uivec3 &first, uivec3 &last) const;
+	size_t index(const unsigned int x, const unsigned int y, const unsigned int z) const;
+	void partitions(const AABox<vec3> &bbox, vector<size_t> &parts) const;
+};
+
+// In-core partitioning: the triangles of every partition as indices into the source triangles, in CSR layout
+struct PartitionIndex {
+	vector<size_t> offsets; // partition i has triangles[offsets[i]] up to triangles[offsets[i+1]]
+	vector<unsigned int> triangles;
+};
+
+// Amount of histogram cells for adaptive partitioning: 64 per equal partition, at most 64^3
+inline size_t adaptiveCells(const size_t n_equal, const size_t gridsize){
+	return min(min(n_equal * 64, (size_t)262144), gridsize * gridsize * gridsize);
+}
+
 // Partitioning-related stuff
 size_t estimate_partitions(const size_t gridsize, const size_t memory_limit);
 void removeTripFiles(const TripInfo &trip_info);
-TripInfo partition(const TriInfo& tri_info, const size_t n_partitions, const size_t gridsize, TriReaderIter *);
+unsigned long long hashTriangles(const TriReaderIter *reader);
+bool findCachedPartitions(const TriInfo& tri_info, const size_t n_partitions, const size_t gridsize, const bool container, const bool adaptive,
+	const bool index_files, const unsigned long long source_hash, TripInfo &trip_info);
+void cachePartitions(const TriInfo& tri_info, const size_t n_partitions, const size_t gridsize, const bool container, const bool adaptive,
+	const bool index_files, const TripInfo &trip_info);
+void mortonRangeBox(const mort_t start, const mort_t end, AABox<uivec3> &bbox_grid);
+TripInfo partition(const TriInfo& tri_info, const size_t n_partitions, const size_t gridsize, TriReaderIter *, const bool container = false, const bool adaptive = false,
+	const bool index_files = false, PartitionIndex* index = NULL, const bool stream_source = false);
 
 #endif /* PARTITIONER_H_ */
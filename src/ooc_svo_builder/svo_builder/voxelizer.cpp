@@ -14,18 +14,29 @@ using namespace trimesh;
 #define Y 1
 #define Z 2
 
-bool compare_and_swap(tbb::atomic<voxel_t> *voxels, mort_t idx)
+bool compare_and_swap(tbb::atomic<voxel_t> *voxels, mort_t idx, voxel_t full = FULL_VOXEL)
 {
     //tbb does not have atomic bit operations: but c++11 does
     //but version 6.0 of CUDA does not support c++11. *sigh*
     //so I can't try my idea for atomicAnd and atomicCAS
     //for CUDA char atomicCAS
 
-    return voxels[idx].compare_and_swap(FULL_VOXEL, EMPTY_VOXEL) == EMPTY_VOXEL;
+    return voxels[idx].compare_and_swap(full, EMPTY_VOXEL) == EMPTY_VOXEL;
+}
+
+// Raise the normal code of a filled voxel to the given one, if that's larger
+void raise_voxel(tbb::atomic<voxel_t> *voxels, mort_t idx, voxel_t code)
+{
+    voxel_t old = voxels[idx];
+    while ((unsigned char)old < (unsigned char)code){
+        const voxel_t seen = voxels[idx].compare_and_swap(code, old);
+        if (seen == old){ return; }
+        old = seen;
+    }
 }
 
 template<char COUNT_ONLY, char CUDA_PARALLEL>
-void voxelize_triangle(const Triangle &t,const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled, const AABox<uivec3> &p_bbox_grid, const float unit_div, const vec3 &delta_p,	size_t data_max_items, int tid = 0)
+void voxelize_triangle(const Triangle &t,const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled, const AABox<uivec3> &p_bbox_grid, const float unit_div, const vec3 &delta_p,	size_t data_max_items, bool keep_normals = false, int tid = 0)
 
 {
     // read triangle
@@ -64,6 +75,7 @@ void voxelize_triangle(const Triangle &t,const mort_t morton_start, const mort_t
     const vec3 e2 = v0 - v2;
     vec3 to_normalize = e0 CROSS e1;
     const vec3 n = normalize(to_normalize); // triangle normal
+    const voxel_t full = keep_normals ? encodeVoxelNormal(n) : FULL_VOXEL; // with payloads, a filled voxel keeps (a coarse version of) the normal
     // PLANE TEST PROPERTIES
     const vec3 c = vec3(n[X] > 0 ? unitlength : 0.0f,
                         n[Y] > 0 ? unitlength : 0.0f,
@@ -102,7 +114,9 @@ void voxelize_triangle(const Triangle &t,const mort_t morton_start, const mort_t
     for (int z=t_bbox_grid.min[2]; z<t_bbox_grid.max[2]+1; z++){
 
         const uint64 index = mortonEncode_LUT(z, y, x);
-        if (voxels[ index - morton_start ] != FULL_VOXEL){
+        if (index < morton_start || index >= morton_end){ continue; } // the bounding box of an adaptive partition can hold voxels of its neighbours
+        // a filled voxel can still get a larger normal code, so it ends up the same whichever triangle gets there first
+        if (voxels[ index - morton_start ] == EMPTY_VOXEL || (keep_normals && (unsigned char)voxels[ index - morton_start ] < (unsigned char)full)){
             // TRIANGLE PLANE THROUGH BOX TEST
             const vec3 p = vec3(x*unitlength, y*unitlength, z*unitlength);
             const float nDOTp = n DOT p;
@@ -127,13 +141,16 @@ void voxelize_triangle(const Triangle &t,const mort_t morton_start, const mort_t
             || (((n_zx_e2 DOT p_zx) + d_xz_e2) < 0.0f)
             )){
                 if (COUNT_ONLY == 0){
-                    if (compare_and_swap(voxels, index - morton_start)){
+                    if (compare_and_swap(voxels, index - morton_start, full)){
                     //voxels[ index - morton_start ] = FULL_VOXEL;
                         if (use_data){
                             nfilled++;
                             data.push_back(index);
                         }
                     }
+                    else if (keep_normals){
+                        raise_voxel(voxels, index - morton_start, full);
+                    }
                 }
             }
         }
@@ -145,11 +162,10 @@ void voxelize_triangle(const Triangle &t,const mort_t morton_start, const mort_t
 void runCPUCUDAStyle(TriReaderIter *reader, const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled, const AABox<uivec3> &p_bbox_grid, const float unit_div, const vec3 &delta_p,	size_t data_max_items)
 {
     //this is
+    const TriangleSpan tris = reader->span();
 #pragma omp parallel for
-    for (int i=0; i<reader->triangles.size(); i++){
-        Triangle t = reader->triangles[i];
-
-        voxelize_triangle<1,1>(t, morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, p_bbox_grid, unit_div, delta_p, data_max_items);
+    for (int i=0; i<tris.size(); i++){
+        voxelize_triangle<1,1>(tris[i], morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, p_bbox_grid, unit_div, delta_p, data_max_items);
     }
 
     data.resize(nfilled);
@@ -157,21 +173,28 @@ void runCPUCUDAStyle(TriReaderIter *reader, const mort_t morton_start, const mor
     memset(voxels, EMPTY_VOXEL, (morton_end - morton_start)*sizeof(char));
 
 #pragma omp parallel for
-    for (int i=0; i<reader->triangles.size(); i++){
-        Triangle t = reader->triangles[i];
-        voxelize_triangle<0,1>(t, morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, p_bbox_grid, unit_div, delta_p, data_max_items);
+    for (int i=0; i<tris.size(); i++){
+        voxelize_triangle<0,1>(tris[i], morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, p_bbox_grid, unit_div, delta_p, data_max_items);
 
     }
 
 }
 
-void runCPUParallel(TriReaderIter *reader, TriReaderIter *orig_reader, const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled, const AABox<uivec3> &p_bbox_grid, const float unit_div, const vec3 &delta_p,	size_t data_max_items)
+// The triangles of a partition: a block of the triangles themselves (read from its file, or the source triangles),
+// or a list of indices into the source triangles
+struct PartitionTriangles {
+    const Triangle* records;
+    const unsigned int* indices;
+    size_t n;
+};
+
+void runCPUParallel(const PartitionTriangles &tris, TriReaderIter *orig_reader, const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled, const AABox<uivec3> &p_bbox_grid, const float unit_div, const vec3 &delta_p,	size_t data_max_items, bool keep_normals)
 {
     int num_threads = 0;
 #pragma omp parallel
     num_threads = omp_get_num_threads();
     size_t start_idx[num_threads];
-    size_t num_tris_per_thread = reader->triangles.size()/num_threads + 1;
+    size_t num_tris_per_thread = tris.n/num_threads + 1;
 
     for (int i=0; i<num_threads; i++){
         start_idx[i] = num_tris_per_thread * i;
@@ -179,12 +202,18 @@ void runCPUParallel(TriReaderIter *reader, TriReaderIter *orig_reader, const mor
 #pragma omp parallel
     {
         const int start = start_idx[omp_get_thread_num()];
-        const int end = std::min(reader->triangles.size(), start_idx[omp_get_thread_num()]+num_tris_per_thread);
+        const int end = std::min(tris.n, start_idx[omp_get_thread_num()]+num_tris_per_thread);
+        const TriangleSpan source = orig_reader->span();
 
-        for (int i=start; i<end; i++){
-            int idx = reader->triangles[i].idx;
-            Triangle t = orig_reader->triangles[idx];
-            voxelize_triangle<0,0>(t, morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, p_bbox_grid, unit_div, delta_p, data_max_items);
+        if (tris.indices == NULL){ // the triangles themselves: this thread's slice of the block, front to back
+            for (int i=start; i<end; i++){
+                voxelize_triangle<0,0>(tris.records[i], morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, p_bbox_grid, unit_div, delta_p, data_max_items, keep_normals);
+            }
+        }
+        else {
+            for (int i=start; i<end; i++){
+                voxelize_triangle<0,0>(source[tris.indices[i]], morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, p_bbox_grid, unit_div, delta_p, data_max_items, keep_normals);
+            }
         }
     }
 }
@@ -193,7 +222,7 @@ void runCPUParallel(TriReaderIter *reader, TriReaderIter *orig_reader, const mor
 // Implementation of algorithm from http://research.michael-schwarz.com/publ/2010/vox/ (Schwarz & Seidel)
 // Adapted for mortoncode -based subgrids
 bool first_time = false;
-void voxelize_schwarz_method(TriReaderIter *reader, TriReaderIter *orig_reader, const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled) {
+static void voxelize_partition(const PartitionTriangles &tris, TriReaderIter *orig_reader, const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled, bool keep_normals) {
 
     vox_algo_timer.start();
     orig_reader->resetCount();
@@ -207,8 +236,7 @@ void voxelize_schwarz_method(TriReaderIter *reader, TriReaderIter *orig_reader,
 
 	// compute partition min and max in grid coords
 	AABox<uivec3> p_bbox_grid;
-	mortonDecode(morton_start, p_bbox_grid.min[2], p_bbox_grid.min[1], p_bbox_grid.min[0]);
-	mortonDecode(morton_end - 1, p_bbox_grid.max[2], p_bbox_grid.max[1], p_bbox_grid.max[0]);
+	mortonRangeBox(morton_start, morton_end, p_bbox_grid);
 
 	// compute maximum grow size for data array
 
@@ -231,8 +259,21 @@ void voxelize_schwarz_method(TriReaderIter *reader, TriReaderIter *orig_reader,
 //         iter != reader.triangles.end(); ++iter){
 
     //runCPUCUDAStyle(reader,morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, p_bbox_grid, unit_div, delta_p, data_max_items);
-    runCPUParallel(reader, orig_reader, morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, p_bbox_grid, unit_div, delta_p, data_max_items);
+    runCPUParallel(tris, orig_reader, morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, p_bbox_grid, unit_div, delta_p, data_max_items, keep_normals);
 
     vox_algo_timer.stop();
 }
 
+
+// Voxelize the triangles read from a partition file (or the source triangles themselves, with just one partition)
+void voxelize_schwarz_method(TriReaderIter *reader, TriReaderIter *orig_reader, const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled, bool keep_normals) {
+    const TriangleSpan part = reader->span();
+    PartitionTriangles tris = { part.data(), NULL, part.size() };
+    voxelize_partition(tris, orig_reader, morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, keep_normals);
+}
+
+// Voxelize the triangles of an in-core partition, given by their indices in the source triangles
+void voxelize_schwarz_method(const unsigned int* tri_indices, const size_t n_triangles, TriReaderIter *orig_reader, const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled, bool keep_normals) {
+    PartitionTriangles tris = { NULL, tri_indices, n_triangles };
+    voxelize_partition(tris, orig_reader, morton_start, morton_end, unitlength, voxels, data, sparseness_limit, use_data, nfilled, keep_normals);
+}
@@ -5,23 +5,56 @@
 #include <tbb/concurrent_vector.h>
 #include <cuda_runtime.h>
 #include "morton.h"
+#include <TriMesh.h>
 
 // Voxelization-related stuff
 typedef unsigned long long int uint64;
 typedef char voxel_t;
 using namespace std;
+using namespace trimesh;
 
 #define EMPTY_VOXEL 0
 #define FULL_VOXEL 1
 #define WORKING_VOXEL 2
 class TriReaderIter;
 
+// With voxel payloads, a filled voxel holds an 8-bit code for the normal of the triangle that filled it instead of FULL_VOXEL
+// (the largest code, if several triangles do): an octahedral map of the unit sphere on a 15x15 grid, plus one
+#define VOXEL_NORMAL_STEPS 15
+
+inline voxel_t encodeVoxelNormal(const vec3 &n){
+	const float sum = fabs(n[0]) + fabs(n[1]) + fabs(n[2]);
+	if (!(sum > 0.0f)){ return (voxel_t)(1 + (VOXEL_NORMAL_STEPS / 2) * VOXEL_NORMAL_STEPS + VOXEL_NORMAL_STEPS / 2); } // degenerate triangle: +z
+	float u = n[0] / sum, v = n[1] / sum;
+	if (n[2] < 0.0f){ // fold the lower half over the diagonals
+		const float fu = (1.0f - fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+		v = (1.0f - fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+		u = fu;
+	}
+	const int iu = (int)((u * 0.5f + 0.5f) * (VOXEL_NORMAL_STEPS - 1) + 0.5f);
+	const int iv = (int)((v * 0.5f + 0.5f) * (VOXEL_NORMAL_STEPS - 1) + 0.5f);
+	return (voxel_t)(1 + iv * VOXEL_NORMAL_STEPS + iu);
+}
+
+inline vec3 decodeVoxelNormal(const voxel_t code){
+	const int c = (int)(unsigned char)code - 1;
+	const float u = (float)(c % VOXEL_NORMAL_STEPS) / (VOXEL_NORMAL_STEPS - 1) * 2.0f - 1.0f;
+	const float v = (float)(c / VOXEL_NORMAL_STEPS) / (VOXEL_NORMAL_STEPS - 1) * 2.0f - 1.0f;
+	vec3 n = vec3(u, v, 1.0f - fabs(u) - fabs(v));
+	if (n[2] < 0.0f){
+		n[0] = (1.0f - fabs(v)) * (u >= 0.0f ? 1.0f : -1.0f);
+		n[1] = (1.0f - fabs(u)) * (v >= 0.0f ? 1.0f : -1.0f);
+	}
+	return normalize(n);
+}
+
 extern "C"
 void cudaRun(const float3* d_v0, const float3*d_v1, const float3*d_v2,const uint64 morton_start, const uint64 morton_end, const float unitlength, tbb::atomic<voxel_t> *voxels, tbb::concurrent_vector<uint64> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled,
              const uint3 &p_bbox_grid_min, const uint3 &p_bbox_grid_max, const float unit_div, const float3 &delta_p,	size_t data_max_items, size_t num_triangles);
 
 
-void voxelize_schwarz_method(TriReaderIter *reader, TriReaderIter *orig_reader, const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled);
+void voxelize_schwarz_method(TriReaderIter *reader, TriReaderIter *orig_reader, const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled, bool keep_normals = false);
+void voxelize_schwarz_method(const unsigned int* tri_indices, const size_t n_triangles, TriReaderIter *orig_reader, const mort_t morton_start, const mort_t morton_end, const float unitlength, tbb::atomic<voxel_t>* voxels, tbb::concurrent_vector<mort_t> &data, float sparseness_limit, bool &use_data, tbb::atomic<size_t> &nfilled, bool keep_normals = false);
 
 
 #endif // VOXELIZER_H_
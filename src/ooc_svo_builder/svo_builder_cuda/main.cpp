@@ -302,7 +302,11 @@ int main(int argc, char *argv[]) {
 	// PARTITIONING
 	part_total_timer.start(); part_io_in_timer.start(); // TIMING
 	readTriHeader(filename, tri_info);
-    TriReaderIter *orig_reader = new TriReaderIter(tri_info.base_filename + string(".tridata"), tri_info.n_triangles, input_buffersize);
+    TriReaderIter *orig_reader = readSourceTriangles(tri_info, input_buffersize);
+	if (orig_reader->triangles.size() != tri_info.n_triangles) {
+		cout << "Could not read all triangles of " << filename << ". Please regenerate using tri_convert." << endl;
+		exit(0);
+	}
 
 	part_io_in_timer.stop();
 	size_t n_partitions = estimate_partitions(gridsize, voxel_memory_limit);
@@ -14,6 +14,8 @@ string version = "1.2";
 // Program parameters
 string filename = "";
 bool recompute_normals = false;
+int quantization = 0; // bits per vertex coordinate in the .tridata file (0: 32-bit floats)
+bool indexed = false; // write shared vertices and vertex indices, instead of independent triangles
 vec3 fixed_color = vec3(1.0f, 1.0f, 1.0f);
 
 void printInfo(){
@@ -40,6 +42,8 @@ void printHelp(){
 	std::cout << "" << endl;
 	std::cout << "-f <filename>         Path to a model input file (.ply, .obj, .3ds, .sm, .ray or .off)." << endl;
 	std::cout << "-r                    Recompute face normals." << endl;
+	std::cout << "-q <16|21>            Quantize vertex coordinates to 16 or 21 bits, for a smaller .tridata file." << endl;
+	std::cout << "-indexed              Write the shared vertices and 3 vertex indices per triangle, instead of a .tridata file." << endl;
 	std::cout << "-h                    Print help and exit." << endl;
 }
 
@@ -59,6 +63,15 @@ void parseProgramParameters(int argc, char* argv[]){
 				i++;
 			} else if (string(argv[i]) == "-r") {
 				recompute_normals = true;
+			} else if (string(argv[i]) == "-q") {
+				quantization = atoi(argv[i + 1]);
+				if (quantization != 16 && quantization != 21) {
+					cout << "Quantization should be 16 or 21 bits." << endl;
+					printInvalid(); exit(0);
+				}
+				i++;
+			} else if (string(argv[i]) == "-indexed") {
+				indexed = true;
 			} else if(string(argv[i]) == "-h") {
 				printHelp(); exit(0);
 			} else {
@@ -67,6 +80,12 @@ void parseProgramParameters(int argc, char* argv[]){
 	}
 	cout << "  filename: " << filename << endl;
 	cout << "  recompute normals: " << recompute_normals << endl;
+	if (indexed && quantization) {
+		cout << "Indexed meshes keep their vertices as floats, ignoring -q." << endl;
+		quantization = 0;
+	}
+	cout << "  quantization: " << quantization << endl;
+	cout << "  indexed: " << indexed << endl;
 }
 
 int main(int argc, char *argv[]){
@@ -94,18 +113,39 @@ int main(int argc, char *argv[]){
 	std::string tri_header_out_name = base + string(".tri");
 	std::string tri_out_name = base + string(".tridata");
 
-	FILE* tri_out = fopen(tri_out_name.c_str(), "wb");
-
-	cout << "Writing mesh triangles ... "; timer.reset();
-	Triangle t = Triangle();
-	// Write all triangles to data file
-	for(size_t i = 0; i < themesh->faces.size(); i++){
-		t.v0 = themesh->vertices[themesh->faces[i][0]];
-		t.v1 = themesh->vertices[themesh->faces[i][1]];
-		t.v2 = themesh->vertices[themesh->faces[i][2]];
-		writeTriangle(tri_out,t);
+	if (indexed) { // the vertices and the faces, as they are
+		cout << "Writing mesh vertices and indices ... "; timer.reset();
+		FILE* vertex_out = fopen((base + string(".trivertices")).c_str(), "wb");
+		if (!themesh->vertices.empty()) { fwrite(&themesh->vertices[0], sizeof(vec3), themesh->vertices.size(), vertex_out); }
+		fclose(vertex_out);
+		vector<unsigned int> indices(3 * themesh->faces.size());
+		for(size_t i = 0; i < themesh->faces.size(); i++){
+			indices[3 * i] = themesh->faces[i][0];
+			indices[3 * i + 1] = themesh->faces[i][1];
+			indices[3 * i + 2] = themesh->faces[i][2];
+		}
+		FILE* index_out = fopen((base + string(".triindices")).c_str(), "wb");
+		if (!indices.empty()) { fwrite(&indices[0], sizeof(unsigned int), indices.size(), index_out); }
+		fclose(index_out);
+		cout << "done in " << timer.getTotalTimeSeconds() << " s." << endl;
+	}
+	else {
+		FILE* tri_out = fopen(tri_out_name.c_str(), "wb");
+
+		cout << "Writing mesh triangles ... "; timer.reset();
+		Triangle t = Triangle();
+		const float step = quantization ? quantizationStep(mesh_bbox, quantization) : 0;
+		// Write all triangles to data file
+		for(size_t i = 0; i < themesh->faces.size(); i++){
+			t.v0 = themesh->vertices[themesh->faces[i][0]];
+			t.v1 = themesh->vertices[themesh->faces[i][1]];
+			t.v2 = themesh->vertices[themesh->faces[i][2]];
+			if (quantization) { writeQuantizedTriangle(tri_out, t, quantization, step); }
+			else { writeTriangle(tri_out,t); }
+		}
+		fclose(tri_out);
+		cout << "done in " << timer.getTotalTimeSeconds() << " ms." << endl;
 	}
-	cout << "done in " << timer.getTotalTimeSeconds() << " ms." << endl;
 
 	// Prepare tri_info and write header
 	cout << "Writing header to " << tri_header_out_name << " ... " << endl;
@@ -114,6 +154,9 @@ int main(int argc, char *argv[]){
 	tri_info.mesh_bbox = mesh_bbox;
 	tri_info.n_triangles = themesh->faces.size();
 	tri_info.geometry_only = 1;
+	tri_info.quantization = quantization;
+	tri_info.indexed = indexed;
+	tri_info.n_vertices = indexed ? themesh->vertices.size() : 0;
 	writeTriHeader(tri_header_out_name, tri_info);
 	tri_info.print();
 	cout << "Done." << endl;
@@ -0,0 +1,84 @@
+#ifndef TRI_MAPPING_H_
+#define TRI_MAPPING_H_
+
+#include <string>
+#include <iostream>
+#include "tri_tools.h"
+
+using namespace std;
+
+// Memory-mapped input is only available on POSIX systems
+#if !defined(_WIN32) && !defined(_WIN64)
+#define MAPPED_TRIANGLES_AVAILABLE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// A read-only mapping of (a range of) the triangles in a .tridata or .tripdata file. Nothing is read or copied: the triangles
+// are served straight from the page cache, and all processes mapping the same file share a single copy of them.
+class TriMapping {
+public:
+	TriMapping() : map(NULL), map_size(0) {}
+	~TriMapping() { unmap(); }
+
+	bool map_triangles(const std::string &filename, const size_t n_triangles, const size_t first_triangle = 0);
+	void unmap();
+	TriangleSpan triangles() const { return view; }
+
+private:
+	void* map; // mapping from the page the first triangle is on
+	size_t map_size;
+	TriangleSpan view;
+
+	TriMapping(const TriMapping&);
+	TriMapping& operator=(const TriMapping&);
+};
+
+// Map n_triangles triangles of a file, starting at the given triangle. Returns false if the file is too short or can't be mapped.
+inline bool TriMapping::map_triangles(const std::string &filename, const size_t n_triangles, const size_t first_triangle){
+	unmap();
+	if (n_triangles == 0) { return true; }
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) { return false; }
+	const size_t triangle_size = TRIANGLE_SIZE * sizeof(float);
+	const size_t start = first_triangle * triangle_size;
+	const size_t bytes = n_triangles * triangle_size;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < start + bytes) {
+		::close(fd);
+		return false;
+	}
+	// mappings start on a page: map from the page the first triangle is on
+	const size_t page = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t map_start = start - start % page;
+	map_size = bytes + (start - map_start);
+	void* p = mmap(NULL, map_size, PROT_READ, MAP_SHARED, fd, (off_t)map_start);
+	::close(fd); // the mapping keeps the file open
+	if (p == MAP_FAILED) {
+		map_size = 0;
+		return false;
+	}
+	map = p;
+#if defined(MADV_SEQUENTIAL)
+	madvise(map, map_size, MADV_SEQUENTIAL); // we run through them front to back: read ahead aggressively
+#endif
+#if defined(MADV_WILLNEED)
+	madvise(map, map_size, MADV_WILLNEED); // and start reading them in now
+#endif
+	view = TriangleSpan((const Triangle*)((const char*)map + (start - map_start)), n_triangles);
+	return true;
+}
+
+inline void TriMapping::unmap(){
+	if (map != NULL) {
+		munmap(map, map_size);
+	}
+	map = NULL;
+	map_size = 0;
+	view = TriangleSpan();
+}
+
+#endif // no Windows
+
+#endif // TRI_MAPPING_H_
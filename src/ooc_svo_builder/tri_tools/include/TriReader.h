@@ -1,12 +1,22 @@
 #ifndef TRI_READER_H_
 #define TRI_READER_H_
 #include "tri_tools.h"
+#include "file_tools.h"
 #include <stdio.h>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 using namespace std;
 using namespace trimesh;
 
-// A class to read triangles from a .tridata file.
+// A class to read triangles from a .tridata file. Quantized triangles (see tri_tools.h) get decoded as they're read.
+// nextBlock() hands them out a block at a time, straight from the read buffer; getTriangle() copies them out one by one.
+// With read-ahead, a thread of its own reads (and decodes) the next buffers into a ring while the current one is handed out,
+// so the reads overlap with whatever is done with the triangles, and only the time spent waiting for them is lost.
 class TriReader{
 protected:
 	size_t n_triangles;
@@ -18,37 +28,100 @@ protected:
 	size_t buffersize; 
 	Triangle* buffer;
 
+	int quantization; // bits per coordinate of the quantized triangles in the file (0: floats)
+	float quantization_step;
+	unsigned char* raw; // quantized triangles, as read from the file
+
 	FILE* file;
 
+	// Read-ahead: the ring of buffers, of which buffer is the one we're handing out
+	std::vector<Triangle*> ring; // empty: no read-ahead, we read into buffer ourselves
+	size_t ring_first; // the buffer we're handing out (or the next one to, if we're not holding one)
+	size_t ring_full; // buffers that have been read and not handed out completely
+	bool ring_holding; // we're handing out ring[ring_first]
+	bool ring_stopping;
+	std::mutex ring_lock;
+	std::condition_variable ring_filled, ring_emptied;
+	std::thread read_ahead_thread;
+
 public:
+	double read_seconds; // time spent reading (and decoding) triangles, by the read-ahead thread
+	double wait_seconds; // time spent waiting for the read-ahead thread
+
 	TriReader();
 	TriReader(const TriReader&);
-    TriReader(const std::string &filename, size_t n_triangles, size_t buffersize);
-    virtual void getTriangle(Triangle& t);
-    virtual Triangle getTriangle();
-    virtual bool hasNext();
+    TriReader(const std::string &filename, size_t n_triangles, size_t buffersize, size_t first_triangle = 0, int quantization = 0, float quantization_step = 0, size_t read_ahead = 0);
+    TriangleSpan nextBlock(size_t max_triangles);
+    void getTriangle(Triangle& t);
+    Triangle getTriangle();
+    bool hasNext();
 	~TriReader();
 private:
-    virtual void fillBuffer();
+    void fillBuffer();
+    void readInto(Triangle* dest, size_t count);
+    void readAhead();
 };
 
-inline TriReader::TriReader(){
-	// TODO
+// An empty reader, for subclasses which get their triangles elsewhere
+inline TriReader::TriReader(): n_triangles(0), n_read(0), n_served(0), current_tri(0), buffersize(0), buffer(NULL), quantization(0), quantization_step(0), raw(NULL), file(NULL),
+	ring_first(0), ring_full(0), ring_holding(false), ring_stopping(false), read_seconds(0), wait_seconds(0){
 }
 
 inline TriReader::TriReader(const TriReader&){
 	// TODO
 }
 
-inline TriReader::TriReader(const std::string &filename, size_t n_triangles, size_t buffersize): n_triangles(n_triangles), buffersize(buffersize), n_read(0), current_tri(0), n_served(0){
-	// prepare buffer
-	buffer = new Triangle[buffersize];
+// Read n_triangles triangles from a file, starting at the given triangle. With read_ahead buffers (at least 2), they're read
+// in the background.
+inline TriReader::TriReader(const std::string &filename, size_t n_triangles, size_t buffersize, size_t first_triangle, int quantization, float quantization_step, size_t read_ahead):
+	n_triangles(n_triangles), buffersize(buffersize), n_read(0), current_tri(0), n_served(0), quantization(quantization), quantization_step(quantization_step), raw(NULL),
+	ring_first(0), ring_full(0), ring_holding(false), ring_stopping(false), read_seconds(0), wait_seconds(0){
+	// prepare buffer(s)
+	buffer = NULL;
+	if (read_ahead > 0) {
+		ring.resize(max(read_ahead, (size_t)2));
+		for (size_t i = 0; i < ring.size(); i++) {
+			ring[i] = new Triangle[buffersize];
+		}
+	}
+	else {
+		buffer = new Triangle[buffersize];
+	}
+	const size_t triangle_size = quantization ? quantizedTriangleSize(quantization) : TRIANGLE_SIZE * sizeof(float);
+	if (quantization) {
+		raw = new unsigned char[buffersize * triangle_size];
+	}
 	// prepare file
 	file = fopen(filename.c_str(), "rb");
-	// fill Buffer
+	if (first_triangle > 0) {
+		seek_file(file, first_triangle * triangle_size);
+	}
+	// fill Buffer, or start reading ahead: the first buffer gets taken from the ring when the first triangle is asked for
+	if (!ring.empty()) {
+		current_tri = buffersize;
+		read_ahead_thread = std::thread(&TriReader::readAhead, this);
+		return;
+	}
 	fillBuffer();
 }
 
+// The next block of (at most max_triangles) triangles, valid until the next call: never more than what's left in the read
+// buffer, which gets refilled once it's all handed out. An empty block means we're done.
+inline TriangleSpan TriReader::nextBlock(size_t max_triangles){
+	if (n_served == n_triangles) {
+		return TriangleSpan();
+	}
+	if (current_tri == buffersize) { // at end of buffer, refill it
+		fillBuffer();
+		current_tri = 0;
+	}
+	const size_t n = min(max_triangles, min(buffersize - current_tri, n_triangles - n_served));
+	TriangleSpan block(buffer + current_tri, n);
+	current_tri += n;
+	n_served += n;
+	return block;
+}
+
 inline Triangle TriReader::getTriangle(){
 	if(current_tri == buffersize){ // at end of buffer, refill it
         TriReader::fillBuffer();
@@ -74,14 +147,89 @@ inline bool TriReader::hasNext(){
 	return (n_served < n_triangles);
 }
 
+// Read count triangles from the file into dest
+inline void TriReader::readInto(Triangle* dest, size_t count){
+	if (quantization) { // read them as they are, then decode
+		size_t read = fread(raw, quantizedTriangleSize(quantization), count, file);
+		if (read < count) { // truncated file: don't decode what's left in the buffer from the previous read
+			cout << "  Error: could only read " << read << " of " << count << " quantized triangles." << endl;
+			std::fill(dest + read, dest + count, Triangle());
+		}
+		dequantizeTriangles(raw, read, quantization, quantization_step, dest);
+	}
+	else {
+		readTriangles(file, dest[0], count); // read new triangles
+	}
+}
+
 inline void TriReader::fillBuffer(){
+	if (!ring.empty()) { // hand the buffer we're done with back to the read-ahead thread, and take the next one
+		std::unique_lock<std::mutex> l(ring_lock);
+		if (ring_holding) {
+			ring_first = (ring_first + 1) % ring.size();
+			ring_full--;
+			ring_emptied.notify_one();
+		}
+		if (ring_full == 0) {
+			const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			while (ring_full == 0) {
+				ring_filled.wait(l);
+			}
+			wait_seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+		ring_holding = true;
+		buffer = ring[ring_first];
+		return;
+	}
 	size_t readcount = min(buffersize, n_triangles - n_read); // don't read more than there are
-	readTriangles(file,buffer[0],readcount); // read new triangles
+	readInto(buffer, readcount); // read new triangles
 	n_read += readcount; // update the number of tri's we've read
 }
 
+// Read-ahead thread: read the triangles buffer by buffer into the ring, as long as there's a free buffer in it
+inline void TriReader::readAhead(){
+	while (n_read < n_triangles) {
+		size_t next;
+		{
+			std::unique_lock<std::mutex> l(ring_lock);
+			while (ring_full == ring.size() && !ring_stopping) {
+				ring_emptied.wait(l);
+			}
+			if (ring_stopping) { return; }
+			next = (ring_first + ring_full) % ring.size();
+		}
+		const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		const size_t readcount = min(buffersize, n_triangles - n_read); // don't read more than there are
+		readInto(ring[next], readcount);
+		n_read += readcount;
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		{
+			std::unique_lock<std::mutex> l(ring_lock);
+			read_seconds += seconds;
+			ring_full++;
+			ring_filled.notify_one();
+		}
+	}
+}
+
 inline TriReader::~TriReader(){
-	delete buffer;
-	fclose(file);
+	if (read_ahead_thread.joinable()) { // stop reading ahead
+		{
+			std::unique_lock<std::mutex> l(ring_lock);
+			ring_stopping = true;
+			ring_emptied.notify_one();
+		}
+		read_ahead_thread.join();
+	}
+	if (ring.empty()) {
+		delete[] buffer;
+	}
+	for (size_t i = 0; i < ring.size(); i++) {
+		delete[] ring[i];
+	}
+	delete[] raw;
+	if (file != NULL) {
+		fclose(file);
+	}
 }
 #endif
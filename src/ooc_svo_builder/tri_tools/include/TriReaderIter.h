@@ -1,57 +1,134 @@
 #ifndef TRIREADERITER_H
 #define TRIREADERITER_H
 #include "TriReader.h"
+#include "TriMapping.h"
 #include <stdio.h>
 
 using namespace std;
 using namespace trimesh;
 
-// A class to read triangles from a .tridata file.
+// A class to read triangles from a .tridata file. They're all read into memory up front, or (on POSIX systems)
+// mapped read-only, in which case they're never copied at all. Either way, span() is a view of all of them,
+// and nextBlock() hands them out in blocks.
 class TriReaderIter : public TriReader{
 public:
-    TriReaderIter() : TriReader(){}
-    TriReaderIter(const TriReader&tr) : TriReader(tr){}
-    TriReaderIter(const std::string &filename, size_t n_triangles, size_t buffersize);
+    TriReaderIter() : TriReader(), mapped_file(false){}
+    TriReaderIter(const TriReader&tr) : TriReader(tr), mapped_file(false){}
+    TriReaderIter(const std::string &filename, size_t n_triangles, size_t buffersize, size_t first_triangle = 0, int quantization = 0, float quantization_step = 0);
+    TriReaderIter(const std::string &vertex_filename, const std::string &index_filename, size_t n_vertices, size_t n_triangles);
+    TriangleSpan nextBlock(size_t max_triangles);
     Triangle getTriangle();
     void getTriangle(Triangle& t);
     void resetCount(){ n_served = 0;current_tri = 0;}
+    bool map(const std::string &filename, size_t n_triangles, size_t first_triangle = 0);
+    TriangleSpan span() const { return view; }
+    bool mapped() const { return mapped_file; }
 
-    virtual bool hasNext();
+    bool hasNext();
     ~TriReaderIter();
-    std::vector<Triangle> triangles;
+    std::vector<Triangle> triangles; // the triangles we read (empty if they're mapped)
 private:
+    TriangleSpan view;
+    bool mapped_file;
+#ifdef MAPPED_TRIANGLES_AVAILABLE
+    TriMapping mapping;
+#endif
     void fillBuffer();
+    void updateView(){ view = TriangleSpan(triangles.empty() ? NULL : &triangles[0], triangles.size()); }
 };
 
-inline TriReaderIter::TriReaderIter(const std::string &filename, size_t n_triangles, size_t buffersize):
-    TriReader(filename, n_triangles, buffersize)
+inline TriReaderIter::TriReaderIter(const std::string &filename, size_t n_triangles, size_t buffersize, size_t first_triangle, int quantization, float quantization_step):
+    TriReader(filename, n_triangles, buffersize, first_triangle, quantization, quantization_step), mapped_file(false)
 {
 
     triangles.reserve(n_triangles);
     fillBuffer();
+    updateView();
     n_served = 0;
     current_tri = 0;
 }
 
 
 
+// Read an indexed mesh: all vertices and all vertex indices in one go each, then expand them into triangles
+inline TriReaderIter::TriReaderIter(const std::string &vertex_filename, const std::string &index_filename, size_t n_vertices, size_t n_triangles):
+    TriReader(), mapped_file(false)
+{
+    std::vector<vec3> vertices(n_vertices);
+    std::vector<unsigned int> indices(3 * n_triangles);
+    FILE* vertex_file = fopen(vertex_filename.c_str(), "rb");
+    FILE* index_file = fopen(index_filename.c_str(), "rb");
+    bool ok = vertex_file != NULL && index_file != NULL
+        && (n_vertices == 0 || fread(&vertices[0], sizeof(vec3), n_vertices, vertex_file) == n_vertices)
+        && (n_triangles == 0 || fread(&indices[0], sizeof(unsigned int), indices.size(), index_file) == indices.size());
+    if (vertex_file != NULL) { fclose(vertex_file); }
+    if (index_file != NULL) { fclose(index_file); }
+    if (!ok) {
+        cout << "  Error: could not read " << n_vertices << " vertices from " << vertex_filename << " and " << n_triangles << " triangles from " << index_filename << endl;
+        return; // no triangles
+    }
+    triangles.resize(n_triangles);
+    for (size_t i = 0; i < n_triangles; i++) {
+        if (indices[3 * i] >= n_vertices || indices[3 * i + 1] >= n_vertices || indices[3 * i + 2] >= n_vertices) {
+            cout << "  Error: triangle " << i << " refers to a vertex beyond the " << n_vertices << " in " << vertex_filename << endl;
+            triangles.clear();
+            return;
+        }
+        triangles[i].v0 = vertices[indices[3 * i]];
+        triangles[i].v1 = vertices[indices[3 * i + 1]];
+        triangles[i].v2 = vertices[indices[3 * i + 2]];
+    }
+    this->n_triangles = n_triangles;
+    n_read = n_triangles;
+    updateView();
+}
+
+// Map n_triangles float triangles of a .tridata/.tripdata file, starting at the given triangle, instead of reading them.
+// Returns false if that's not possible here, or if it failed: the reader is left empty then.
+inline bool TriReaderIter::map(const std::string &filename, size_t n_triangles, size_t first_triangle){
+#ifdef MAPPED_TRIANGLES_AVAILABLE
+    triangles.clear();
+    if (!mapping.map_triangles(filename, n_triangles, first_triangle)) {
+        return false;
+    }
+    view = mapping.triangles();
+    mapped_file = true;
+    this->n_triangles = n_triangles;
+    n_read = n_triangles;
+    n_served = 0;
+    current_tri = 0;
+    return true;
+#else
+    return false;
+#endif
+}
+
 inline bool TriReaderIter::hasNext(){
     return (n_served < n_triangles);
 }
 
+// Read all triangles, a read buffer at a time
 inline void TriReaderIter::fillBuffer(){
-    while(TriReader::hasNext()){
-        Triangle t = TriReader::getTriangle();
-        triangles.push_back(t);
+    TriangleSpan block;
+    while (!(block = TriReader::nextBlock(buffersize)).empty()) {
+        triangles.insert(triangles.end(), block.begin(), block.end());
     }
+}
 
+// The next block of (at most max_triangles) triangles: they're all in memory, so it's just a part of span()
+inline TriangleSpan TriReaderIter::nextBlock(size_t max_triangles){
+    const size_t n = min(max_triangles, view.size() - min(view.size(), current_tri));
+    TriangleSpan block(view.data() + current_tri, n);
+    current_tri += n;
+    n_served += n;
+    return block;
 }
 
 inline TriReaderIter::~TriReaderIter(){
 }
 
 inline Triangle TriReaderIter::getTriangle(){
-    Triangle t = triangles[current_tri]; // assign triangle from buffer
+    Triangle t = view[current_tri]; // assign triangle from memory
     current_tri++; // set index for next triangle
     n_served++;
     return t;
@@ -61,4 +138,28 @@ inline void TriReaderIter::getTriangle(Triangle& t){
     t = getTriangle();
 }
 
+// Map n_triangles triangles of a .tridata/.tripdata file if asked to (and we can), read them otherwise
+inline TriReaderIter* openTriangles(const std::string &filename, size_t n_triangles, size_t buffersize, size_t first_triangle = 0, bool mapped = false){
+    if (mapped) {
+        TriReaderIter* reader = new TriReaderIter();
+        if (reader->map(filename, n_triangles, first_triangle)) {
+            return reader;
+        }
+        delete reader;
+    }
+    return new TriReaderIter(filename, n_triangles, buffersize, first_triangle);
+}
+
+// Read all source triangles of a .tri mesh, whatever the layout of its data files. Float triangles can be mapped instead.
+inline TriReaderIter* readSourceTriangles(const TriInfo &tri_info, size_t buffersize, bool mapped = false){
+    if (tri_info.indexed) {
+        return new TriReaderIter(tri_info.base_filename + string(".trivertices"), tri_info.base_filename + string(".triindices"), tri_info.n_vertices, tri_info.n_triangles);
+    }
+    if (tri_info.quantization == 0) {
+        return openTriangles(tri_info.base_filename + string(".tridata"), tri_info.n_triangles, buffersize, 0, mapped);
+    }
+    return new TriReaderIter(tri_info.base_filename + string(".tridata"), tri_info.n_triangles, buffersize, 0,
+        tri_info.quantization, quantizationStep(tri_info.mesh_bbox, tri_info.quantization));
+}
+
 #endif // TRIREADERITER_H
@@ -3,20 +3,65 @@
 
 #include <string>
 #include <stdio.h>
+#if defined(_WIN32) || defined(_WIN64)
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#endif
 
 using namespace std;
 
 // Various file operations, implemented in standard C
 
-// Copy files from src to dst using stdio
+// Seek to a (64-bit) byte offset from the start of a file
+inline int seek_file(FILE* f, const size_t offset){
+#if defined(_WIN32) || defined(_WIN64)
+	return _fseeki64(f, (__int64) offset, SEEK_SET);
+#else
+	return fseeko(f, (off_t) offset, SEEK_SET);
+#endif
+}
+
+// Grow a file we're writing to the given size up front, returns false if that failed
+inline bool preallocate_file(FILE* f, const size_t size){
+	fflush(f);
+#if defined(_WIN32) || defined(_WIN64)
+	return _chsize_s(_fileno(f), (__int64) size) == 0;
+#else
+#if defined(__linux__)
+	if (posix_fallocate(fileno(f), 0, (off_t) size) == 0) { return true; } // real blocks, in as few extents as possible
+#endif
+	return ftruncate(fileno(f), (off_t) size) == 0;
+#endif
+}
+
+// Copy files from src to dst. On Linux the kernel copies (or reflinks) the data with copy_file_range,
+// elsewhere (or if that's not supported) we copy using stdio, in large blocks.
 inline void copy_file(const std::string& src, const std::string& dst){
-	char buf[8192];
-    size_t size;
 	FILE* source = fopen(src.c_str(), "rb");
     FILE* dest = fopen(dst.c_str(), "wb");
-    while (size = fread(buf, 1, BUFSIZ, source)) {
+#if defined(__linux__)
+	ssize_t copied;
+	do {
+		copied = copy_file_range(fileno(source), NULL, fileno(dest), NULL, 1 << 30, 0);
+	} while (copied > 0);
+	if (copied == 0) { // done
+		fclose(source);
+		fclose(dest);
+		return;
+	}
+	seek_file(source, 0); // not supported between these files: start over
+	seek_file(dest, 0);
+#endif
+	const size_t buffersize = 1024 * 1024;
+	char* buf = new char[buffersize];
+    size_t size;
+    while ((size = fread(buf, 1, buffersize, source)) > 0) {
         fwrite(buf, 1, size, dest);
     }
+	delete[] buf;
     fclose(source);
     fclose(dest);
 }
@@ -31,4 +76,19 @@ inline bool file_exists(const std::string& name) {
 	}   
 }
 
+// Size of a file in bytes using stdio (0 if it doesn't exist)
+inline size_t file_size(const std::string& name) {
+	FILE* file = fopen(name.c_str(), "rb");
+	if (file == NULL) { return 0; }
+#if defined(_WIN32) || defined(_WIN64)
+	_fseeki64(file, 0, SEEK_END);
+	size_t size = (size_t) _ftelli64(file);
+#else
+	fseeko(file, 0, SEEK_END);
+	size_t size = (size_t) ftello(file);
+#endif
+	fclose(file);
+	return size;
+}
+
 #endif
\ No newline at end of file
@@ -4,8 +4,13 @@
 #include <string>
 #include <fstream>
 #include <stdio.h>
+#include <string.h>
 #include "tri_util.h"
 #include "file_tools.h"
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define TRI_TOOLS_SSE2
+#endif
 
 using namespace std;
 
@@ -16,8 +21,11 @@ struct TriInfo{
 	int geometry_only;
 	size_t n_triangles;
 	AABox<vec3> mesh_bbox;
+	int quantization; // bits per vertex coordinate of the triangles in the .tridata file (0: 32-bit floats)
+	bool indexed; // shared vertices: a .trivertices file with the vertices, and a .triindices file with 3 vertex indices per triangle
+	size_t n_vertices;
 
-	TriInfo() : base_filename(""), version(version), geometry_only(geometry_only), n_triangles(0), mesh_bbox(AABox<vec3>()) {} // default constructor
+	TriInfo() : base_filename(""), version(version), geometry_only(geometry_only), n_triangles(0), mesh_bbox(AABox<vec3>()), quantization(0), indexed(false), n_vertices(0) {} // default constructor
 
 	// print out Tri information
 	void print() const{
@@ -27,16 +35,38 @@ struct TriInfo{
 		cout << "  n_triangles: " << n_triangles << endl;
 		cout << "  bbox min: " << mesh_bbox.min[0] << " " << mesh_bbox.min[1] << " " << mesh_bbox.min[2] << endl;
 		cout << "  bbox max: " << mesh_bbox.max[0] << " " << mesh_bbox.max[1] << " " << mesh_bbox.max[2] << endl;
+		cout << "  quantization: " << quantization << endl;
+		cout << "  indexed: " << indexed << endl;
+		if (indexed) { cout << "  n_vertices: " << n_vertices << endl; }
 	}
 
 	// check if all files required by Tri exist
 	bool filesExist() const{
 		string header = base_filename + string(".tri");
+		if (indexed) {
+			return (file_exists(header) && file_exists(base_filename + string(".trivertices")) && file_exists(base_filename + string(".triindices")));
+		}
 		string tridata = base_filename + string(".tridata");
 		return (file_exists(header) && file_exists(tridata));
 	}
 };
 
+// A read-only view of n contiguous triangles, wherever they are: in a vector, a read buffer or a mapped file
+struct TriangleSpan {
+	const Triangle* first;
+	size_t n;
+
+	TriangleSpan() : first(NULL), n(0) {}
+	TriangleSpan(const Triangle* first, const size_t n) : first(first), n(n) {}
+
+	size_t size() const { return n; }
+	bool empty() const { return n == 0; }
+	const Triangle* data() const { return first; }
+	const Triangle* begin() const { return first; }
+	const Triangle* end() const { return first + n; }
+	const Triangle& operator[](const size_t i) const { return first[i]; }
+};
+
 // STDIO IO for Triangles
 inline void readTriangle(FILE* f, Triangle &t){
 	size_t read = fread(&t, TRIANGLE_SIZE*sizeof(float), 1, f);
@@ -54,6 +84,85 @@ inline void writeTriangles(FILE* f, Triangle &t, size_t howmany){
 	fwrite(&t, TRIANGLE_SIZE*sizeof(float), howmany, f);
 }
 
+// Quantized triangles: the vertex coordinates are fixed-point numbers between 0 and the side of the (cubic) mesh bbox, since
+// tri_convert moves the mesh to the origin. 16 bits: 9 unsigned shorts (18 bytes). 21 bits: a 64-bit word per vertex,
+// with x in the lowest bits (24 bytes). There's no idx: the reader leaves that to whoever looks triangles up.
+inline size_t quantizedTriangleSize(const int bits){
+	return (bits == 16) ? 9 * sizeof(unsigned short) : 3 * sizeof(unsigned long long);
+}
+
+// The size of a quantization step for a mesh with the given bbox
+inline float quantizationStep(const AABox<vec3> &bbox, const int bits){
+	return (bbox.max[0] - bbox.min[0]) / (float)((1u << bits) - 1);
+}
+
+inline unsigned int quantizeCoordinate(const float v, const float step, const int bits){
+	const float q = v / step + 0.5f;
+	const float max_q = (float)((1u << bits) - 1);
+	return (unsigned int)(q < 0.0f ? 0.0f : (q > max_q ? max_q : q));
+}
+
+inline void writeQuantizedTriangle(FILE* f, Triangle &t, const int bits, const float step){
+	const float* v = &t.v0[0];
+	if (bits == 16){
+		unsigned short q[9];
+		for (int i = 0; i < 9; i++){ q[i] = (unsigned short) quantizeCoordinate(v[i], step, 16); }
+		fwrite(q, sizeof(q), 1, f);
+	} else {
+		unsigned long long q[3];
+		for (int i = 0; i < 3; i++){
+			q[i] = (unsigned long long) quantizeCoordinate(v[3 * i], step, 21) | ((unsigned long long) quantizeCoordinate(v[3 * i + 1], step, 21) << 21)
+				| ((unsigned long long) quantizeCoordinate(v[3 * i + 2], step, 21) << 42);
+		}
+		fwrite(q, sizeof(q), 1, f);
+	}
+}
+
+// Decode n quantized triangles into out, leaving their idx alone. With SSE2, the first 8 coordinates of a triangle are converted together.
+inline void dequantizeTriangles(const unsigned char* in, const size_t n, const int bits, const float step, Triangle* out){
+	const size_t size = quantizedTriangleSize(bits);
+#ifdef TRI_TOOLS_SSE2
+	const __m128 s = _mm_set1_ps(step);
+	const __m128i zero = _mm_setzero_si128();
+#endif
+	for (size_t t = 0; t < n; t++){
+		const unsigned char* q = in + t * size;
+		float* v = &out[t].v0[0];
+#ifdef TRI_TOOLS_SSE2
+		if (bits == 16){ // widen the shorts straight to floats
+			const __m128i packed = _mm_loadu_si128((const __m128i*) q); // first 8 of 9 coordinates
+			_mm_storeu_ps(v, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(packed, zero)), s));
+			_mm_storeu_ps(v + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(packed, zero)), s));
+			unsigned short last;
+			memcpy(&last, q + 8 * sizeof(unsigned short), sizeof(last));
+			v[8] = (float) last * step;
+			continue;
+		}
+#endif
+		int c[9]; // the fixed-point coordinates
+		if (bits == 16){
+			unsigned short s16[9];
+			memcpy(s16, q, sizeof(s16));
+			for (int i = 0; i < 9; i++){ c[i] = s16[i]; }
+		} else {
+			unsigned long long s64[3];
+			memcpy(s64, q, sizeof(s64));
+			for (int i = 0; i < 3; i++){
+				c[3 * i] = (int)(s64[i] & 0x1FFFFF);
+				c[3 * i + 1] = (int)((s64[i] >> 21) & 0x1FFFFF);
+				c[3 * i + 2] = (int)((s64[i] >> 42) & 0x1FFFFF);
+			}
+		}
+#ifdef TRI_TOOLS_SSE2
+		_mm_storeu_ps(v, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) c)), s));
+		_mm_storeu_ps(v + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*) (c + 4))), s));
+		v[8] = (float) c[8] * step;
+#else
+		for (int i = 0; i < 9; i++){ v[i] = (float) c[i] * step; }
+#endif
+	}
+}
+
 // FSTREAM IO for Triangles (deprecated - this slow)
 inline void readTriangle(ifstream &file, Triangle &t){
 	file.read(reinterpret_cast<char*> (&t.v0[0]), TRIANGLE_SIZE*sizeof(float));
@@ -91,6 +200,9 @@ inline int parseTriHeader(std::string filename, TriInfo &t){
 
 	bool done = false;
 	t.geometry_only = 0;
+	t.quantization = 0;
+	t.indexed = false;
+	t.n_vertices = 0;
 
 	while(file.good() && !done) {
 		file >> line;
@@ -102,6 +214,12 @@ inline int parseTriHeader(std::string filename, TriInfo &t){
 			file >> t.geometry_only;
 		} else if (line.compare("bbox") == 0) {
 			file >> t.mesh_bbox.min[0] >> t.mesh_bbox.min[1] >> t.mesh_bbox.min[2] >> t.mesh_bbox.max[0] >> t.mesh_bbox.max[1] >> t.mesh_bbox.max[2];
+		} else if (line.compare("quantized") == 0) {
+			file >> t.quantization;
+		} else if (line.compare("indexed") == 0) {
+			file >> t.indexed;
+		} else if (line.compare("nvertices") == 0) {
+			file >> t.n_vertices;
 		} else { 
 			cout << "  unrecognized keyword [" << line << "], skipping" << endl;
 			char c; do { c = file.get(); } while(file.good() && (c != '\n'));
@@ -110,6 +228,12 @@ inline int parseTriHeader(std::string filename, TriInfo &t){
 	if (!done) {
 		cout << "  error reading header" << endl; return 0;
 	}
+	if (t.quantization != 0 && t.quantization != 16 && t.quantization != 21) {
+		cout << "  Error: triangles quantized to " << t.quantization << " bits, only 16 or 21 bits are supported" << endl; return 0;
+	}
+	if (t.indexed && t.quantization != 0) {
+		cout << "  Error: indexed meshes can't be quantized" << endl; return 0;
+	}
 	file.close();
 	return 1;
 }
@@ -123,6 +247,8 @@ inline void writeTriHeader(const std::string &filename, const TriInfo &t){
 	outfile << "geo_only " << t.geometry_only << endl;
 	outfile << "bbox  " << t.mesh_bbox.min[0] << " " << t.mesh_bbox.min[1] << " " << t.mesh_bbox.min[2] << " " << t.mesh_bbox.max[0] << " " 
 		<< t.mesh_bbox.max[1] << " " << t.mesh_bbox.max[2] << endl;
+	if (t.quantization != 0) { outfile << "quantized " << t.quantization << endl; }
+	if (t.indexed) { outfile << "indexed 1" << endl << "nvertices " << t.n_vertices << endl; }
 	outfile << "END" << endl;
 	outfile.close();
 }
@@ -19,11 +19,53 @@ struct TripInfo {
 	size_t n_triangles;
 	size_t n_partitions;
 	vector<size_t> part_tricounts;
+	bool container; // all partitions are stored in one .tripdata file, partition i starts at triangle part_offsets[i]
+	vector<size_t> part_offsets;
+	bool in_core; // partitions are voxelized straight from the source triangles in memory (all of them, or an index), there are no .tripdata files
+	size_t index_bytes; // the .tripdata files hold indices of source triangles of this many bytes, instead of triangles (0: triangles)
+	vector<size_t> part_starts; // adaptive partitioning: partition i spans morton codes [part_starts[i], part_starts[i+1]) (empty: equal partitions)
+	unsigned long long source_hash; // hash of the source triangles these partitions were made from (0: unknown)
 
 	// default constructor
-	TripInfo() : base_filename(""), version(1), geometry_only(0), gridsize(0), n_triangles(0), n_partitions(0), mesh_bbox(AABox<vec3>()) {} 
+	TripInfo() : base_filename(""), version(1), geometry_only(0), gridsize(0), n_triangles(0), n_partitions(0), mesh_bbox(AABox<vec3>()), container(false), in_core(false), index_bytes(0), source_hash(0) {} 
 	// construct from TriInfo
-	TripInfo(const TriInfo &t) : base_filename(t.base_filename), version(t.version), geometry_only(t.geometry_only), gridsize(0), mesh_bbox(t.mesh_bbox), n_triangles(t.n_triangles), n_partitions(0) {} 
+	TripInfo(const TriInfo &t) : base_filename(t.base_filename), version(t.version), geometry_only(t.geometry_only), gridsize(0), mesh_bbox(t.mesh_bbox), n_triangles(t.n_triangles), n_partitions(0), container(false), in_core(false), index_bytes(0), source_hash(0) {} 
+
+	// the file the triangles of a partition are in
+	string getPartitionFilename(size_t i) const{
+		if (container) { return base_filename + string(".tripdata"); }
+		return base_filename + string("_") + val_to_string(i) + string(".tripdata");
+	}
+
+	// the position (in triangles) of the first triangle of a partition in its file
+	size_t getPartitionOffset(size_t i) const{
+		return container ? part_offsets[i] : 0;
+	}
+
+	// the size of a triangle in the partition files: a full triangle, or its index
+	size_t getRecordSize() const{
+		return index_bytes ? index_bytes : TRIANGLE_SIZE * sizeof(float);
+	}
+
+	// the first morton code of a partition (partition n_partitions starts at the end of the grid)
+	size_t getPartitionStart(size_t i) const{
+		if (!part_starts.empty()) { return part_starts[i]; }
+		return i * ((gridsize * gridsize * gridsize) / n_partitions);
+	}
+
+	// the morton code just past the end of a partition
+	size_t getPartitionEnd(size_t i) const{
+		return getPartitionStart(i + 1);
+	}
+
+	// the amount of voxels in the largest partition
+	size_t getMaxPartitionLength() const{
+		size_t length = 0;
+		for(size_t i = 0; i < n_partitions; i++){
+			length = max(length, getPartitionEnd(i) - getPartitionStart(i));
+		}
+		return length;
+	}
 
 	void print() const{
 		cout << "  base_filename: " << base_filename << endl;
@@ -34,16 +76,33 @@ struct TripInfo {
 		cout << "  bbox max: " << mesh_bbox.max[0] << " " << mesh_bbox.max[1] << " " << mesh_bbox.max[2] << endl;
 		cout << "  n_triangles: " << n_triangles << endl;
 		cout << "  n_partitions: " << n_partitions << endl;
+		cout << "  container: " << container << endl;
+		cout << "  in core: " << in_core << endl;
+		cout << "  index bytes: " << index_bytes << endl;
+		cout << "  source hash: " << hex << source_hash << dec << endl;
 		for(size_t i = 0; i< n_partitions; i++){
-			cout << "  partition " << i << " - tri_count: " << part_tricounts[i] << endl;
+			cout << "  partition " << i << " - tri_count: " << part_tricounts[i];
+			if (container) { cout << " - offset: " << part_offsets[i]; }
+			if (!part_starts.empty()) { cout << " - morton: " << part_starts[i] << " to " << part_starts[i + 1]; }
+			cout << endl;
 		}
 	}
 
+	// check if the partition files are all there, and large enough for the triangles they should hold
+	bool filesComplete() const{
+		for(size_t i = 0; i< n_partitions && !in_core; i++){
+			if(part_tricounts[i] > 0 && file_size(getPartitionFilename(i)) < (getPartitionOffset(i) + part_tricounts[i]) * getRecordSize()){
+				return false;
+			}
+		}
+		return filesExist();
+	}
+
 	bool filesExist() const{
 		string header = base_filename + string(".trip");
-		for(size_t i = 0; i< n_partitions; i++){
+		for(size_t i = 0; i< n_partitions && !in_core; i++){
 			if(part_tricounts[i] > 0){ // we only require the file to be there if it contains any triangles.
-				string part_data_filename = base_filename + string("_") + val_to_string(i) + string(".tripdata");
+				string part_data_filename = getPartitionFilename(i);
 				if(!file_exists(part_data_filename)){
 					return false;
 				}
@@ -67,6 +126,11 @@ inline int parseTripHeader(const std::string &filename, TripInfo &t){
 
 	bool done = false;
 	t.geometry_only = 0;
+	t.container = false;
+	t.in_core = false;
+	t.index_bytes = 0;
+	t.part_starts.clear();
+	t.source_hash = 0;
 
 	while(file.good() && !done) {
 		file >> line;
@@ -89,6 +153,31 @@ inline int parseTripHeader(const std::string &filename, TripInfo &t){
 				file >> index >> tricount;
 				t.part_tricounts[index] = tricount;
 			}
+		} else if (line.compare("container") == 0) {
+			file >> t.container;
+		} else if (line.compare("in_core") == 0) {
+			file >> t.in_core;
+		} else if (line.compare("index_bytes") == 0) {
+			file >> t.index_bytes;
+		} else if (line.compare("part_offsets") == 0) {
+			t.part_offsets.resize(t.n_partitions); // comes after n_partitions
+			int index;
+			size_t offset;
+			for(size_t i = 0; i < t.n_partitions; i++){
+				file >> index >> offset;
+				t.part_offsets[index] = offset;
+			}
+		} else if (line.compare("source_hash") == 0) {
+			file >> hex >> t.source_hash >> dec;
+		} else if (line.compare("part_ranges") == 0) {
+			t.part_starts.resize(t.n_partitions + 1); // comes after n_partitions
+			int index;
+			size_t start, end;
+			for(size_t i = 0; i < t.n_partitions; i++){
+				file >> index >> start >> end;
+				t.part_starts[index] = start;
+				t.part_starts[index + 1] = end;
+			}
 		} else { 
 			cout << "  unrecognized keyword [" << line << "], skipping" << endl;
 			char c; do { c = file.get(); } while(file.good() && (c != '\n'));
@@ -111,17 +200,40 @@ inline void writeTripHeader(const std::string &filename, const TripInfo &t){
 	outfile << "n_triangles " << t.n_triangles << endl;
 	outfile << "bbox  " << t.mesh_bbox.min[0] << " " << t.mesh_bbox.min[1] << " " << t.mesh_bbox.min[2] << " " << t.mesh_bbox.max[0] << " " 
 		<< t.mesh_bbox.max[1] << " " << t.mesh_bbox.max[2] << endl;
-#ifdef BINARY_VOXELIZATION
-	outfile << "geo_only " << 1 << endl;
-#else
-	outfile << "geo_only " << 0 << endl;
-#endif
+	outfile << "geo_only " << t.geometry_only << endl;
 	outfile << "n_partitions " << t.n_partitions << endl;
 
 	for(size_t i = 0; i < t.n_partitions; i++){
 		outfile << i << " " << t.part_tricounts[i] << endl;
 	}
+	if (t.in_core) { outfile << "in_core 1" << endl; }
+	if (t.index_bytes != 0) { outfile << "index_bytes " << t.index_bytes << endl; }
+	if (t.container) { // offset table into the container file
+		outfile << "container 1" << endl;
+		outfile << "part_offsets" << endl;
+		for(size_t i = 0; i < t.n_partitions; i++){
+			outfile << i << " " << t.part_offsets[i] << endl;
+		}
+	}
+	if (t.source_hash != 0) { outfile << "source_hash " << hex << t.source_hash << dec << endl; }
+	if (!t.part_starts.empty()) { // morton range table of adaptive partitions
+		outfile << "part_ranges" << endl;
+		for(size_t i = 0; i < t.n_partitions; i++){
+			outfile << i << " " << t.part_starts[i] << " " << t.part_starts[i + 1] << endl;
+		}
+	}
 	outfile << "END" << endl;
 }
 
+// Read the triangle indices of a partition from an index-only partition file, in one go. Returns false if that failed.
+inline bool readPartitionIndices(const TripInfo &t, const size_t i, vector<unsigned int> &indices){
+	indices.resize(t.part_tricounts[i]);
+	if (indices.empty()) { return true; }
+	FILE* file = fopen(t.getPartitionFilename(i).c_str(), "rb");
+	if (file == NULL) { return false; }
+	bool ok = seek_file(file, t.getPartitionOffset(i) * t.index_bytes) == 0 && fread(&indices[0], t.index_bytes, indices.size(), file) == indices.size();
+	fclose(file);
+	return ok;
+}
+
 #endif